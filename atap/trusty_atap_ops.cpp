@@ -194,6 +194,10 @@ AtapResult TrustyAtapOps::write_attestation_key(
     if (slot == AttestationKeySlot::kInvalid) {
         return ATAP_RESULT_ERROR_INVALID_INPUT;
     }
+    StorageTransaction transaction;
+    if (transaction.error() != KM_ERROR_OK) {
+        return ATAP_RESULT_ERROR_STORAGE;
+    }
     keymaster_error_t result =
             WriteKeyToStorage(slot, key->data, key->data_length);
     if (result != KM_ERROR_OK) {
@@ -209,6 +213,11 @@ AtapResult TrustyAtapOps::write_attestation_key(
             return ATAP_RESULT_ERROR_STORAGE;
         }
     }
+    result = transaction.Commit();
+    if (result != KM_ERROR_OK) {
+        LOG_E("Failed to commit slot %d (err = %d)", slot, result);
+        return ATAP_RESULT_ERROR_STORAGE;
+    }
     return ATAP_RESULT_OK;
 }
 
@@ -0,0 +1,58 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <trusty_ipc.h>
+#include <trusty_uuid.h>
+
+/*
+ * Client side of the host loopback tipc implementation in trusty_syscalls.cpp.
+ * The TA thread uses the regular Trusty IPC syscalls; a client thread uses
+ * these calls to talk to it. All calls block and return a negative Trusty
+ * error code on failure.
+ */
+
+/**
+ * Connects to |port|, identifying the client as |peer_uuid|. Blocks until the
+ * port has been created by the TA. Returns a channel handle.
+ */
+long host_ipc_connect(const char* port, const uuid_t* peer_uuid);
+
+/**
+ * Queues one message of |len| bytes at |buf| on |chan|.
+ */
+long host_ipc_send(handle_t chan, const void* buf, size_t len);
+
+/**
+ * Waits for the next message on |chan| and copies up to |len| bytes of it to
+ * |buf|. Returns the full message length.
+ */
+long host_ipc_recv(handle_t chan, void* buf, size_t len);
+
+/**
+ * Closes the client end of |chan|. The TA sees IPC_HANDLE_POLL_HUP.
+ */
+void host_ipc_close(handle_t chan);
+
+/**
+ * Makes every pending and future wait_any() in the TA return
+ * ERR_CHANNEL_CLOSED so that its event loop exits.
+ */
+void host_ipc_shutdown(void);
@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Host stand-in for lib/hwkey. Keys are derived as
+ * HMAC-SHA256(kHostDeviceKey, src) truncated to the requested size, so blobs
+ * created by one host run can be loaded by the next.
+ */
+
+#include <string.h>
+
+#include <openssl/hmac.h>
+#include <openssl/sha.h>
+
+#include <lib/hwkey/hwkey.h>
+#include <uapi/err.h>
+
+namespace {
+
+const uint8_t kHostDeviceKey[32] = "keymaster host build device key";
+const hwkey_session_t kHostSession = 1;
+
+}  // namespace
+
+extern "C" {
+
+long hwkey_open(void) {
+    return kHostSession;
+}
+
+long hwkey_derive(hwkey_session_t session,
+                  uint32_t* kdf_version,
+                  const uint8_t* src,
+                  uint8_t* dest,
+                  uint32_t buf_size) {
+    if (session != kHostSession)
+        return ERR_BAD_HANDLE;
+    if (*kdf_version != HWKEY_KDF_VERSION_1)
+        return ERR_NOT_SUPPORTED;
+
+    if (buf_size > SHA256_DIGEST_LENGTH)
+        return ERR_NOT_SUPPORTED;
+
+    uint8_t block[SHA256_DIGEST_LENGTH];
+    unsigned int len;
+    if (!HMAC(EVP_sha256(), kHostDeviceKey, sizeof(kHostDeviceKey), src,
+              buf_size, block, &len)) {
+        return ERR_GENERIC;
+    }
+    memcpy(dest, block, buf_size);
+    memset(block, 0, sizeof(block));
+    return NO_ERROR;
+}
+
+void hwkey_close(hwkey_session_t session) {}
+
+}  // extern "C"
@@ -0,0 +1,109 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+/*
+ * Host replacement for libc-trusty's trusty_ipc.h. Several tipc syscalls share
+ * their names with POSIX calls (close, wait, accept, connect), so they are
+ * renamed to host_tipc_* here. The libc headers that declare the POSIX
+ * versions are pulled in first so that later includes do not see the macros.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <trusty_uuid.h>
+
+typedef int32_t handle_t;
+
+#define INVALID_IPC_HANDLE ((handle_t)-1)
+
+#define IPC_PORT_ALLOW_TA_CONNECT 0x1
+#define IPC_PORT_ALLOW_NS_CONNECT 0x2
+
+#define IPC_HANDLE_POLL_NONE 0x0
+#define IPC_HANDLE_POLL_READY 0x1
+#define IPC_HANDLE_POLL_ERROR 0x2
+#define IPC_HANDLE_POLL_HUP 0x4
+#define IPC_HANDLE_POLL_MSG 0x8
+#define IPC_HANDLE_POLL_SEND_UNBLOCKED 0x10
+
+typedef struct uevent {
+    handle_t handle;
+    uint32_t event;
+    void* cookie;
+} uevent_t;
+
+#define UEVENT_INITIAL_VALUE(event) \
+    { INVALID_IPC_HANDLE, 0, NULL }
+
+typedef struct iovec_host {
+    void* base;
+    size_t len;
+} iovec_t;
+
+typedef struct ipc_msg {
+    uint32_t num_iov;
+    iovec_t* iov;
+    uint32_t num_handles;
+    handle_t* handles;
+} ipc_msg_t;
+
+typedef struct ipc_msg_info {
+    size_t len;
+    uint32_t id;
+    uint32_t num_handles;
+} ipc_msg_info_t;
+
+#define port_create host_tipc_port_create
+#define accept host_tipc_accept
+#define close host_tipc_close
+#define set_cookie host_tipc_set_cookie
+#define wait host_tipc_wait
+#define wait_any host_tipc_wait_any
+#define get_msg host_tipc_get_msg
+#define read_msg host_tipc_read_msg
+#define put_msg host_tipc_put_msg
+#define send_msg host_tipc_send_msg
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+long port_create(const char* path,
+                 uint32_t num_recv_bufs,
+                 size_t recv_buf_size,
+                 uint32_t flags);
+long accept(uint32_t handle_id, uuid_t* peer_uuid);
+long close(uint32_t handle_id);
+long set_cookie(uint32_t handle, void* cookie);
+long wait(uint32_t handle_id, uevent_t* event, uint32_t timeout_msecs);
+long wait_any(uevent_t* event, uint32_t timeout_msecs);
+long get_msg(uint32_t handle, ipc_msg_info_t* msg_info);
+long read_msg(uint32_t handle,
+              uint32_t msg_id,
+              uint32_t offset,
+              ipc_msg_t* msg);
+long put_msg(uint32_t handle, uint32_t msg_id);
+long send_msg(uint32_t handle, ipc_msg_t* msg);
+
+#ifdef __cplusplus
+}
+#endif
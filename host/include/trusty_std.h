@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+/*
+ * Host replacement for libc-trusty's trusty_std.h. Only the pieces the
+ * keymaster TA uses are provided; they are implemented in trusty_syscalls.cpp.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <trusty_ipc.h>
+
+typedef int status_t;
+
+#ifndef MIN
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+#endif
+#ifndef MAX
+#define MAX(a, b) (((a) > (b)) ? (a) : (b))
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+long gettime(uint32_t clock_id, uint32_t flags, int64_t* time);
+int memcpy_s(void* dest, size_t destsz, const void* src, size_t count);
+
+#ifdef __cplusplus
+}
+#endif
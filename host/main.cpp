@@ -0,0 +1,392 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Host driver for the keymaster TA. The TA event loop runs on its own thread
+ * exactly as it does on device; this thread plays the non-secure client and
+ * replays a fixed workload over the loopback keymaster port, printing the
+ * average latency of each command.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <interface/keymaster/keymaster.h>
+#include <keymaster/android_keymaster_messages.h>
+#include <keymaster/authorization_set.h>
+#include <uapi/err.h>
+
+#include "host_ipc.h"
+#include "ipc/keymaster_ipc.h"
+#include "trusty_keymaster_messages.h"
+
+using namespace keymaster;
+
+int keymaster_app_main(void);
+
+namespace {
+
+const int kDefaultIterations = 1000;
+const int kAttestIterations = 10;
+const uint32_t kOsVersion = 90000;
+const uint32_t kOsPatchlevel = 201810;
+
+// Message size agreed with the TA through KM_GET_VERSION.
+uint32_t g_max_msg_size = KEYMASTER_MAX_BUFFER_LENGTH;
+
+struct Timer {
+    const char* name;
+    uint64_t total_ns = 0;
+    uint64_t count = 0;
+};
+
+Timer g_timers[] = {
+        {"GENERATE_KEY"}, {"BEGIN_OPERATION"}, {"UPDATE_OPERATION"},
+        {"FINISH_OPERATION"}, {"GET_KEY_CHARACTERISTICS"}, {"ATTEST_KEY"},
+        {"ONESHOT_OPERATION"},
+};
+
+enum TimerId {
+    kTimerGenerate,
+    kTimerBegin,
+    kTimerUpdate,
+    kTimerFinish,
+    kTimerGetChars,
+    kTimerAttest,
+    kTimerOneshot,
+};
+
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * KM_GET_VERSION request and reply carrying the message size extension
+ * described in keymaster_ipc.h.
+ */
+struct GetVersionWithMessageSizeRequest : public KeymasterMessage {
+    GetVersionWithMessageSizeRequest() : KeymasterMessage(0) {}
+
+    size_t SerializedSize() const override { return sizeof(max_msg_size); }
+    uint8_t* Serialize(uint8_t* buf, const uint8_t* end) const override {
+        return append_uint32_to_buf(buf, end, max_msg_size);
+    }
+    bool Deserialize(const uint8_t** buf_ptr, const uint8_t* end) override {
+        return copy_uint32_from_buf(buf_ptr, end, &max_msg_size);
+    }
+
+    uint32_t max_msg_size;
+};
+
+struct GetVersionWithMessageSizeResponse : public GetVersionResponse {
+    size_t NonErrorSerializedSize() const override {
+        return GetVersionResponse::NonErrorSerializedSize() +
+               sizeof(max_msg_size);
+    }
+    uint8_t* NonErrorSerialize(uint8_t* buf,
+                               const uint8_t* end) const override {
+        buf = GetVersionResponse::NonErrorSerialize(buf, end);
+        return append_uint32_to_buf(buf, end, max_msg_size);
+    }
+    // A TA without the extension sends no size; keep the default then.
+    bool NonErrorDeserialize(const uint8_t** buf_ptr,
+                             const uint8_t* end) override {
+        max_msg_size = KEYMASTER_MAX_BUFFER_LENGTH;
+        if (!GetVersionResponse::NonErrorDeserialize(buf_ptr, end))
+            return false;
+        return *buf_ptr == end ||
+               copy_uint32_from_buf(buf_ptr, end, &max_msg_size);
+    }
+
+    uint32_t max_msg_size;
+};
+
+void* ta_thread(void* arg) {
+    keymaster_app_main();
+    return nullptr;
+}
+
+/*
+ * Collects the (possibly multi-message) reply to the last request sent on
+ * |chan| in |rsp_buf|.
+ */
+bool km_recv(handle_t chan, Buffer* rsp_buf) {
+    uint8_t in_buf[KEYMASTER_MAX_MESSAGE_SIZE];
+    keymaster_message* in_msg = reinterpret_cast<keymaster_message*>(in_buf);
+    do {
+        long len = host_ipc_recv(chan, in_buf, sizeof(in_buf));
+        if (len < (long)sizeof(*in_msg))
+            return false;
+        size_t payload_size = len - sizeof(*in_msg);
+        if (!rsp_buf->reserve(rsp_buf->available_read() + payload_size) ||
+            !rsp_buf->write(in_msg->payload, payload_size))
+            return false;
+    } while (!(in_msg->cmd & KEYMASTER_STOP_BIT));
+    return true;
+}
+
+/*
+ * Sends |req| as |cmd| on |chan|, split into KM_REQUEST_FRAGMENT messages if
+ * it does not fit in one, and reassembles the (possibly multi-message) reply
+ * into |rsp|. Returns false on transport or decoding failure.
+ */
+bool km_call(handle_t chan,
+             uint32_t cmd,
+             const KeymasterMessage& req,
+             KeymasterResponse* rsp,
+             TimerId timer = (TimerId)-1) {
+    size_t req_size = req.SerializedSize();
+    if (sizeof(keymaster_message) + req_size > KEYMASTER_MAX_REQUEST_LENGTH) {
+        fprintf(stderr, "request for cmd %u too large (%zu)\n", cmd, req_size);
+        return false;
+    }
+    Buffer req_buf(req_size);
+    req.Serialize(req_buf.peek_write(), req_buf.peek_write() + req_size);
+    req_buf.advance_write(req_size);
+
+    uint64_t start = now_ns();
+    uint8_t msg_buf[KEYMASTER_MAX_MESSAGE_SIZE];
+    keymaster_message* msg = reinterpret_cast<keymaster_message*>(msg_buf);
+    const size_t max_payload = g_max_msg_size - sizeof(*msg);
+    size_t sent = 0;
+    do {
+        size_t chunk = req_size - sent;
+        msg->cmd = cmd;
+        if (chunk > max_payload) {
+            chunk = max_payload;
+            msg->cmd = KM_REQUEST_FRAGMENT;
+        }
+        memcpy(msg->payload, req_buf.peek_read() + sent, chunk);
+        if (host_ipc_send(chan, msg_buf, sizeof(*msg) + chunk) < 0)
+            return false;
+        sent += chunk;
+    } while (sent < req_size);
+
+    Buffer rsp_buf;
+    if (!km_recv(chan, &rsp_buf))
+        return false;
+    if (timer >= 0) {
+        g_timers[timer].total_ns += now_ns() - start;
+        g_timers[timer].count++;
+    }
+
+    const uint8_t* p = rsp_buf.peek_read();
+    if (!rsp->Deserialize(&p, p + rsp_buf.available_read()))
+        return false;
+    if (rsp->error != KM_ERROR_OK) {
+        fprintf(stderr, "cmd %u failed with %d\n", cmd, rsp->error);
+        return false;
+    }
+    return true;
+}
+
+bool run_workload(handle_t chan, int iterations) {
+    GetVersionWithMessageSizeRequest version_req;
+    GetVersionWithMessageSizeResponse version_rsp;
+    version_req.max_msg_size = KEYMASTER_MAX_MESSAGE_SIZE;
+    if (!km_call(chan, KM_GET_VERSION, version_req, &version_rsp))
+        return false;
+    if (version_rsp.max_msg_size > KEYMASTER_MAX_MESSAGE_SIZE) {
+        fprintf(stderr, "TA agreed to unexpected message size %u\n",
+                version_rsp.max_msg_size);
+        return false;
+    }
+    g_max_msg_size = version_rsp.max_msg_size;
+    int32_t ver = MessageVersion(version_rsp.major_ver, version_rsp.minor_ver,
+                                 version_rsp.subminor_ver);
+
+    SetBootParamsRequest boot_req(ver);
+    SetBootParamsResponse boot_rsp;
+    boot_req.os_version = kOsVersion;
+    boot_req.os_patchlevel = kOsPatchlevel;
+    boot_req.device_locked = 1;
+    boot_req.verified_boot_state = KM_VERIFIED_BOOT_VERIFIED;
+    boot_req.verified_boot_key.Reinitialize("host verified boot key 00000000",
+                                            32);
+    boot_req.verified_boot_hash.Reinitialize("host verified boot hash 0000000",
+                                             32);
+    if (!km_call(chan, KM_SET_BOOT_PARAMS, boot_req, &boot_rsp))
+        return false;
+
+    ConfigureRequest configure_req(ver);
+    ConfigureResponse configure_rsp(ver);
+    configure_req.os_version = kOsVersion;
+    configure_req.os_patchlevel = kOsPatchlevel;
+    if (!km_call(chan, KM_CONFIGURE, configure_req, &configure_rsp))
+        return false;
+
+    GenerateKeyRequest gen_req(ver);
+    GenerateKeyResponse gen_rsp(ver);
+    gen_req.key_description.Reinitialize(
+            AuthorizationSetBuilder()
+                    .EcdsaSigningKey(256)
+                    .Digest(KM_DIGEST_SHA_2_256)
+                    .Authorization(TAG_NO_AUTH_REQUIRED));
+    if (!km_call(chan, KM_GENERATE_KEY, gen_req, &gen_rsp, kTimerGenerate))
+        return false;
+
+    uint8_t digest[32];
+    memset(digest, 0xa5, sizeof(digest));
+    AuthorizationSet op_params(
+            AuthorizationSetBuilder().Digest(KM_DIGEST_SHA_2_256));
+
+    for (int i = 0; i < iterations; i++) {
+        GetKeyCharacteristicsRequest chars_req(ver);
+        GetKeyCharacteristicsResponse chars_rsp(ver);
+        chars_req.SetKeyMaterial(gen_rsp.key_blob);
+        if (!km_call(chan, KM_GET_KEY_CHARACTERISTICS, chars_req, &chars_rsp,
+                     kTimerGetChars))
+            return false;
+
+        BeginOperationRequest begin_req(ver);
+        BeginOperationResponse begin_rsp(ver);
+        begin_req.purpose = KM_PURPOSE_SIGN;
+        begin_req.SetKeyMaterial(gen_rsp.key_blob);
+        begin_req.additional_params.Reinitialize(op_params);
+        if (!km_call(chan, KM_BEGIN_OPERATION, begin_req, &begin_rsp,
+                     kTimerBegin))
+            return false;
+
+        UpdateOperationRequest update_req(ver);
+        UpdateOperationResponse update_rsp(ver);
+        update_req.op_handle = begin_rsp.op_handle;
+        update_req.input.Reinitialize(digest, sizeof(digest));
+        if (!km_call(chan, KM_UPDATE_OPERATION, update_req, &update_rsp,
+                     kTimerUpdate))
+            return false;
+
+        FinishOperationRequest finish_req(ver);
+        FinishOperationResponse finish_rsp(ver);
+        finish_req.op_handle = begin_rsp.op_handle;
+        if (!km_call(chan, KM_FINISH_OPERATION, finish_req, &finish_rsp,
+                     kTimerFinish))
+            return false;
+
+        OneshotOperationRequest oneshot_req(ver);
+        OneshotOperationResponse oneshot_rsp(ver);
+        oneshot_req.purpose = KM_PURPOSE_SIGN;
+        oneshot_req.key_blob.Reinitialize(gen_rsp.key_blob.key_material,
+                                          gen_rsp.key_blob.key_material_size);
+        oneshot_req.additional_params.Reinitialize(op_params);
+        oneshot_req.input.Reinitialize(digest, sizeof(digest));
+        if (!km_call(chan, KM_ONESHOT_OPERATION, oneshot_req, &oneshot_rsp,
+                     kTimerOneshot))
+            return false;
+    }
+
+    // Large enough to need several request fragments.
+    uint8_t bulk[3 * KEYMASTER_MAX_BUFFER_LENGTH];
+    memset(bulk, 0x5a, sizeof(bulk));
+    OneshotOperationRequest bulk_req(ver);
+    OneshotOperationResponse bulk_rsp(ver);
+    bulk_req.purpose = KM_PURPOSE_SIGN;
+    bulk_req.key_blob.Reinitialize(gen_rsp.key_blob.key_material,
+                                   gen_rsp.key_blob.key_material_size);
+    bulk_req.additional_params.Reinitialize(op_params);
+    bulk_req.input.Reinitialize(bulk, sizeof(bulk));
+    if (!km_call(chan, KM_ONESHOT_OPERATION, bulk_req, &bulk_rsp))
+        return false;
+
+    for (int i = 0; i < kAttestIterations; i++) {
+        AttestKeyRequest attest_req(ver);
+        AttestKeyResponse attest_rsp(ver);
+        attest_req.SetKeyMaterial(gen_rsp.key_blob);
+        attest_req.attest_params.Reinitialize(
+                AuthorizationSetBuilder()
+                        .Authorization(TAG_ATTESTATION_CHALLENGE, "challenge",
+                                       9)
+                        .Authorization(TAG_ATTESTATION_APPLICATION_ID,
+                                       "host", 4));
+        if (!km_call(chan, KM_ATTEST_KEY, attest_req, &attest_rsp,
+                     kTimerAttest))
+            return false;
+    }
+    return true;
+}
+
+/*
+ * Fetches the TA's own per-command counters through KM_GET_STATS, resetting
+ * them, and prints the average time each command spent in the TA.
+ */
+bool print_ta_stats(handle_t chan) {
+    struct {
+        keymaster_message hdr;
+        uint32_t flags;
+    } req = {{KM_GET_STATS}, KEYMASTER_STATS_RESET};
+    if (host_ipc_send(chan, &req, sizeof(req)) < 0)
+        return false;
+
+    Buffer rsp_buf;
+    if (!km_recv(chan, &rsp_buf))
+        return false;
+    keymaster_stats_header header;
+    if (rsp_buf.available_read() < sizeof(header))
+        return false;
+    memcpy(&header, rsp_buf.peek_read(), sizeof(header));
+    if (rsp_buf.available_read() !=
+        sizeof(header) + header.num_commands * sizeof(keymaster_command_stats))
+        return false;
+
+    const uint8_t* pos = rsp_buf.peek_read() + sizeof(header);
+    for (uint32_t i = 0; i < header.num_commands; i++) {
+        keymaster_command_stats entry;
+        memcpy(&entry, pos + i * sizeof(entry), sizeof(entry));
+        printf("TA cmd 0x%-6x %8u calls %6u errors %10.1f us/call\n",
+               entry.cmd >> KEYMASTER_REQ_SHIFT, entry.calls, entry.errors,
+               (double)entry.total_latency_us / entry.calls);
+    }
+    return true;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    int iterations = argc > 1 ? atoi(argv[1]) : kDefaultIterations;
+
+    pthread_t ta;
+    if (pthread_create(&ta, nullptr, ta_thread, nullptr) != 0) {
+        fprintf(stderr, "failed to start TA thread\n");
+        return 1;
+    }
+
+    uuid_t ns_uuid = {};
+    long chan = host_ipc_connect(KEYMASTER_PORT, &ns_uuid);
+    bool ok = chan >= 0 && run_workload((handle_t)chan, iterations) &&
+              print_ta_stats((handle_t)chan);
+    if (chan >= 0)
+        host_ipc_close((handle_t)chan);
+
+    host_ipc_shutdown();
+    pthread_join(ta, nullptr);
+
+    for (const Timer& t : g_timers) {
+        if (t.count) {
+            printf("%-24s %8llu calls %10.1f us/call\n", t.name,
+                   (unsigned long long)t.count,
+                   (double)t.total_ns / t.count / 1000);
+        }
+    }
+    if (!ok) {
+        fprintf(stderr, "workload failed\n");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,41 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Host stand-in for lib/rng. Both the "secure" and "hardware" sources are
+ * BoringSSL's RAND_bytes; added entropy is discarded.
+ */
+
+#include <openssl/rand.h>
+
+#include <lib/rng/trusty_rng.h>
+#include <uapi/err.h>
+
+extern "C" {
+
+int trusty_rng_secure_rand(uint8_t* data, size_t len) {
+    return RAND_bytes(data, len) == 1 ? NO_ERROR : ERR_GENERIC;
+}
+
+int trusty_rng_hw_rand(uint8_t* data, size_t len) {
+    return RAND_bytes(data, len) == 1 ? NO_ERROR : ERR_GENERIC;
+}
+
+int trusty_rng_add_entropy(const uint8_t* data, size_t len) {
+    return NO_ERROR;
+}
+
+}  // extern "C"
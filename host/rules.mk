@@ -0,0 +1,123 @@
+# Copyright (C) 2018 The Android Open Source Project
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+
+#
+# Linux host build of the keymaster TA. The shipped context, storage, IPC
+# dispatch and TrustyKeymaster sources are compiled unchanged and linked
+# against in-process stand-ins for the Trusty services they call:
+#
+#   tipc     - loopback channels between the TA thread and a client thread
+#   storage  - one host file per storage object under KM_HOST_STORAGE_DIR
+#   hwkey    - deterministic HMAC-SHA256 KDF over a fixed host device key
+#   rng      - BoringSSL RAND_bytes
+#
+# The resulting binary runs a fixed keymaster workload over the loopback
+# channel, so it can be run under perf, valgrind/massif and friends:
+#
+#   make keymaster_host
+#   ./keymaster_host [iterations]
+#
+
+LOCAL_DIR := $(GET_LOCAL_DIR)
+
+KM_APP_DIR := $(LOCAL_DIR)/..
+ANDROID_ROOT := $(KM_APP_DIR)/../../..
+KEYMASTER_ROOT := $(ANDROID_ROOT)/system/keymaster
+TRUSTY_LIB_ROOT := $(KM_APP_DIR)/../../lib
+
+HOST_TEST := keymaster_host
+
+HOST_SRCS := \
+	$(KEYMASTER_ROOT)/android_keymaster/android_keymaster.cpp \
+	$(KEYMASTER_ROOT)/android_keymaster/android_keymaster_messages.cpp \
+	$(KEYMASTER_ROOT)/android_keymaster/android_keymaster_utils.cpp \
+	$(KEYMASTER_ROOT)/android_keymaster/keymaster_enforcement.cpp \
+	$(KEYMASTER_ROOT)/android_keymaster/logger.cpp \
+	$(KEYMASTER_ROOT)/android_keymaster/authorization_set.cpp \
+	$(KEYMASTER_ROOT)/android_keymaster/operation.cpp \
+	$(KEYMASTER_ROOT)/android_keymaster/operation_table.cpp \
+	$(KEYMASTER_ROOT)/android_keymaster/serializable.cpp \
+	$(KEYMASTER_ROOT)/android_keymaster/keymaster_stl.cpp \
+	$(KEYMASTER_ROOT)/android_keymaster/keymaster_tags.cpp \
+	$(KEYMASTER_ROOT)/key_blob_utils/auth_encrypted_key_blob.cpp \
+	$(KEYMASTER_ROOT)/key_blob_utils/ocb.c \
+	$(KEYMASTER_ROOT)/key_blob_utils/ocb_utils.cpp \
+	$(KEYMASTER_ROOT)/km_openssl/aes_key.cpp \
+	$(KEYMASTER_ROOT)/km_openssl/aes_operation.cpp \
+	$(KEYMASTER_ROOT)/km_openssl/asymmetric_key.cpp \
+	$(KEYMASTER_ROOT)/km_openssl/asymmetric_key_factory.cpp \
+	$(KEYMASTER_ROOT)/km_openssl/attestation_record.cpp \
+	$(KEYMASTER_ROOT)/km_openssl/attestation_utils.cpp \
+	$(KEYMASTER_ROOT)/km_openssl/block_cipher_operation.cpp \
+	$(KEYMASTER_ROOT)/km_openssl/ckdf.cpp \
+	$(KEYMASTER_ROOT)/km_openssl/ec_key.cpp \
+	$(KEYMASTER_ROOT)/km_openssl/ec_key_factory.cpp \
+	$(KEYMASTER_ROOT)/km_openssl/ecdsa_operation.cpp \
+	$(KEYMASTER_ROOT)/km_openssl/hmac_key.cpp \
+	$(KEYMASTER_ROOT)/km_openssl/hmac_operation.cpp \
+	$(KEYMASTER_ROOT)/km_openssl/openssl_err.cpp \
+	$(KEYMASTER_ROOT)/km_openssl/openssl_utils.cpp \
+	$(KEYMASTER_ROOT)/km_openssl/rsa_key.cpp \
+	$(KEYMASTER_ROOT)/km_openssl/rsa_key_factory.cpp \
+	$(KEYMASTER_ROOT)/km_openssl/rsa_operation.cpp \
+	$(KEYMASTER_ROOT)/km_openssl/software_random_source.cpp \
+	$(KEYMASTER_ROOT)/km_openssl/symmetric_key.cpp \
+	$(ANDROID_ROOT)/external/tinyxml2/tinyxml2.cpp \
+	$(ANDROID_ROOT)/external/lzma/C/LzmaDec.c \
+	$(KM_APP_DIR)/openssl_keymaster_enforcement.cpp \
+	$(KM_APP_DIR)/test_attestation_keys.cpp \
+	$(KM_APP_DIR)/trusty_entropy_pool.cpp \
+	$(KM_APP_DIR)/trusty_key_cache.cpp \
+	$(KM_APP_DIR)/trusty_key_pool.cpp \
+	$(KM_APP_DIR)/trusty_keymaster.cpp \
+	$(KM_APP_DIR)/trusty_keymaster_context.cpp \
+	$(KM_APP_DIR)/trusty_keymaster_enforcement.cpp \
+	$(KM_APP_DIR)/secure_storage.cpp \
+	$(KM_APP_DIR)/ipc/command_stats.cpp \
+	$(KM_APP_DIR)/ipc/keymaster_ipc.cpp \
+	$(KM_APP_DIR)/ipc/message_arena.cpp \
+	$(KM_APP_DIR)/provision/provision_keybox.cpp \
+	$(LOCAL_DIR)/hwkey_fake.cpp \
+	$(LOCAL_DIR)/rng_soft.cpp \
+	$(LOCAL_DIR)/storage_file.cpp \
+	$(LOCAL_DIR)/trusty_syscalls.cpp \
+	$(LOCAL_DIR)/main.cpp
+
+HOST_INCLUDE_DIRS := \
+	$(LOCAL_DIR)/include \
+	$(KEYMASTER_ROOT)/include \
+	$(KEYMASTER_ROOT) \
+	$(ANDROID_ROOT)/hardware/libhardware/include \
+	$(ANDROID_ROOT)/external/tinyxml2 \
+	$(ANDROID_ROOT)/external/lzma/C \
+	$(TRUSTY_LIB_ROOT)/include \
+	$(TRUSTY_LIB_ROOT)/libc-trusty/include \
+	$(TRUSTY_LIB_ROOT)/storage/include \
+	$(TRUSTY_LIB_ROOT)/hwkey/include \
+	$(TRUSTY_LIB_ROOT)/rng/include \
+	$(TRUSTY_LIB_ROOT)/trusty_syscall_x86/include \
+	$(KM_APP_DIR)/../../interface/keymaster/include \
+	$(KM_APP_DIR) \
+	$(LOCAL_DIR)
+
+HOST_FLAGS := -std=c++14 -fno-short-enums -U__ANDROID__ -D__TRUSTY__ \
+	-DDISABLE_ATAP_SUPPORT -DKEYMASTER_HOST_BUILD -g -fno-omit-frame-pointer
+
+HOST_LIBS := \
+	stdc++ \
+	crypto \
+	pthread
+
+include make/host_test.mk
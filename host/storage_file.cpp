@@ -0,0 +1,171 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Host stand-in for lib/storage. Each storage object is a regular file in the
+ * directory named by KM_HOST_STORAGE_DIR (default "km_host_storage"). Every
+ * write is applied immediately; STORAGE_OP_COMPLETE is accepted and ignored.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <lib/storage/storage.h>
+#include <uapi/err.h>
+
+namespace {
+
+const char* kDefaultStorageDir = "km_host_storage";
+const size_t kMaxOpenFiles = 32;
+const size_t kMaxPathLength = 256;
+
+FILE* g_files[kMaxOpenFiles];
+
+const char* storage_dir() {
+    const char* dir = getenv("KM_HOST_STORAGE_DIR");
+    return dir ? dir : kDefaultStorageDir;
+}
+
+bool storage_path(const char* name, char* path) {
+    int n = snprintf(path, kMaxPathLength, "%s/%s", storage_dir(), name);
+    return n > 0 && (size_t)n < kMaxPathLength;
+}
+
+FILE* get_file(file_handle_t handle) {
+    if (handle >= kMaxOpenFiles)
+        return nullptr;
+    return g_files[handle];
+}
+
+}  // namespace
+
+extern "C" {
+
+int storage_open_session(storage_session_t* session_p, const char* type) {
+    if (mkdir(storage_dir(), 0700) != 0 && errno != EEXIST)
+        return ERR_IO;
+    *session_p = 1;
+    return NO_ERROR;
+}
+
+void storage_close_session(storage_session_t session) {}
+
+int storage_open_file(storage_session_t session,
+                      file_handle_t* handle_p,
+                      const char* name,
+                      uint32_t flags,
+                      uint32_t opflags) {
+    char path[kMaxPathLength];
+    if (!storage_path(name, path))
+        return ERR_NOT_VALID;
+
+    size_t slot;
+    for (slot = 0; slot < kMaxOpenFiles; slot++) {
+        if (!g_files[slot])
+            break;
+    }
+    if (slot == kMaxOpenFiles)
+        return ERR_NO_RESOURCES;
+
+    struct stat st;
+    bool exists = stat(path, &st) == 0;
+    if (exists && (flags & STORAGE_FILE_OPEN_CREATE_EXCLUSIVE))
+        return ERR_ALREADY_EXISTS;
+    if (!exists && !(flags & (STORAGE_FILE_OPEN_CREATE |
+                              STORAGE_FILE_OPEN_CREATE_EXCLUSIVE)))
+        return ERR_NOT_FOUND;
+
+    const char* mode =
+            (!exists || (flags & STORAGE_FILE_OPEN_TRUNCATE)) ? "w+b" : "r+b";
+    FILE* f = fopen(path, mode);
+    if (!f)
+        return ERR_IO;
+
+    g_files[slot] = f;
+    *handle_p = slot;
+    return NO_ERROR;
+}
+
+void storage_close_file(file_handle_t handle) {
+    FILE* f = get_file(handle);
+    if (!f)
+        return;
+    fclose(f);
+    g_files[handle] = nullptr;
+}
+
+int storage_delete_file(storage_session_t session,
+                        const char* name,
+                        uint32_t opflags) {
+    char path[kMaxPathLength];
+    if (!storage_path(name, path))
+        return ERR_NOT_VALID;
+    if (remove(path) != 0)
+        return errno == ENOENT ? ERR_NOT_FOUND : ERR_IO;
+    return NO_ERROR;
+}
+
+ssize_t storage_read(file_handle_t handle,
+                     storage_off_t off,
+                     void* buf,
+                     size_t size) {
+    FILE* f = get_file(handle);
+    if (!f)
+        return ERR_BAD_HANDLE;
+    if (fseek(f, off, SEEK_SET) != 0)
+        return ERR_IO;
+    size_t n = fread(buf, 1, size, f);
+    if (n < size && ferror(f))
+        return ERR_IO;
+    return n;
+}
+
+ssize_t storage_write(file_handle_t handle,
+                      storage_off_t off,
+                      const void* buf,
+                      size_t size,
+                      uint32_t opflags) {
+    FILE* f = get_file(handle);
+    if (!f)
+        return ERR_BAD_HANDLE;
+    if (fseek(f, off, SEEK_SET) != 0)
+        return ERR_IO;
+    if (fwrite(buf, 1, size, f) != size || fflush(f) != 0)
+        return ERR_IO;
+    return size;
+}
+
+int storage_get_file_size(file_handle_t handle, storage_off_t* size) {
+    FILE* f = get_file(handle);
+    if (!f)
+        return ERR_BAD_HANDLE;
+    if (fseek(f, 0, SEEK_END) != 0)
+        return ERR_IO;
+    long pos = ftell(f);
+    if (pos < 0)
+        return ERR_IO;
+    *size = pos;
+    return NO_ERROR;
+}
+
+int storage_end_transaction(storage_session_t session, bool complete) {
+    return NO_ERROR;
+}
+
+}  // extern "C"
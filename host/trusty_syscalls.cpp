@@ -0,0 +1,445 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Host stand-ins for the Trusty syscalls used by the keymaster TA: a loopback
+ * implementation of the tipc port/channel API, gettime() and the x86 device
+ * info call used by keybox provisioning. The tipc entry points keep their
+ * Trusty names here; include/trusty_ipc.h maps them to host_tipc_*.
+ */
+
+#include "host_ipc.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <trusty_device_info.h>
+#include <trusty_std.h>
+#include <uapi/err.h>
+
+namespace {
+
+// Depth of the client side receive queue. Responses beyond this many
+// unconsumed messages make send_msg() fail with ERR_NOT_ENOUGH_BUFFER, as on
+// a real NS client.
+const size_t kClientRecvBufs = 8;
+
+struct HostMsg {
+    uint32_t id;
+    bool retrieved;
+    std::vector<uint8_t> data;
+};
+
+struct HostHandle {
+    bool is_port = false;
+    bool is_client = false;
+    void* cookie = nullptr;
+
+    // Port state.
+    std::string path;
+    size_t num_recv_bufs = 0;
+    std::deque<handle_t> pending;
+
+    // Channel state.
+    handle_t peer = INVALID_IPC_HANDLE;
+    bool peer_closed = false;
+    uuid_t peer_uuid = {};
+    size_t num_recv_bufs_chan = 0;
+    uint32_t next_msg_id = 1;
+    std::deque<HostMsg> inbox;
+    bool send_blocked = false;
+    bool send_unblocked = false;
+};
+
+std::mutex g_lock;
+std::condition_variable g_cond;
+std::vector<HostHandle*> g_handles(1, nullptr);
+size_t g_next_poll = 0;
+bool g_shutdown = false;
+
+HostHandle* get_handle(uint32_t h) {
+    if (h >= g_handles.size())
+        return nullptr;
+    return g_handles[h];
+}
+
+handle_t new_handle(HostHandle* hh) {
+    for (size_t i = 1; i < g_handles.size(); i++) {
+        if (!g_handles[i]) {
+            g_handles[i] = hh;
+            return (handle_t)i;
+        }
+    }
+    g_handles.push_back(hh);
+    return (handle_t)(g_handles.size() - 1);
+}
+
+HostHandle* find_port(const char* path) {
+    for (HostHandle* hh : g_handles) {
+        if (hh && hh->is_port && hh->path == path)
+            return hh;
+    }
+    return nullptr;
+}
+
+bool has_unretrieved(const HostHandle* hh) {
+    for (const HostMsg& m : hh->inbox) {
+        if (!m.retrieved)
+            return true;
+    }
+    return false;
+}
+
+// Returns the pending event mask for a TA-owned handle. Edge triggered
+// events are consumed.
+uint32_t poll_handle(HostHandle* hh) {
+    uint32_t event = 0;
+    if (hh->is_port) {
+        if (!hh->pending.empty())
+            event |= IPC_HANDLE_POLL_READY;
+        return event;
+    }
+    if (has_unretrieved(hh))
+        event |= IPC_HANDLE_POLL_MSG;
+    if (hh->peer_closed)
+        event |= IPC_HANDLE_POLL_HUP;
+    if (hh->send_unblocked) {
+        event |= IPC_HANDLE_POLL_SEND_UNBLOCKED;
+        hh->send_unblocked = false;
+    }
+    return event;
+}
+
+bool wait_locked(std::unique_lock<std::mutex>& lock,
+                 uint32_t timeout_msecs,
+                 const std::function<bool()>& ready) {
+    if (timeout_msecs == UINT32_MAX) {
+        g_cond.wait(lock, ready);
+        return true;
+    }
+    return g_cond.wait_for(lock, std::chrono::milliseconds(timeout_msecs),
+                           ready);
+}
+
+long queue_msg(HostHandle* to, const ipc_msg_t* msg) {
+    HostMsg m;
+    m.id = to->next_msg_id++;
+    m.retrieved = false;
+    for (uint32_t i = 0; i < msg->num_iov; i++) {
+        const uint8_t* base = static_cast<const uint8_t*>(msg->iov[i].base);
+        m.data.insert(m.data.end(), base, base + msg->iov[i].len);
+    }
+    long len = m.data.size();
+    to->inbox.push_back(std::move(m));
+    g_cond.notify_all();
+    return len;
+}
+
+HostMsg* find_msg(HostHandle* hh, uint32_t msg_id) {
+    for (HostMsg& m : hh->inbox) {
+        if (m.id == msg_id)
+            return &m;
+    }
+    return nullptr;
+}
+
+}  // namespace
+
+extern "C" {
+
+long port_create(const char* path,
+                 uint32_t num_recv_bufs,
+                 size_t recv_buf_size,
+                 uint32_t flags) {
+    std::lock_guard<std::mutex> lock(g_lock);
+    if (find_port(path))
+        return ERR_ALREADY_EXISTS;
+    HostHandle* hh = new HostHandle;
+    hh->is_port = true;
+    hh->path = path;
+    hh->num_recv_bufs = num_recv_bufs;
+    handle_t h = new_handle(hh);
+    g_cond.notify_all();
+    return h;
+}
+
+long accept(uint32_t handle_id, uuid_t* peer_uuid) {
+    std::lock_guard<std::mutex> lock(g_lock);
+    HostHandle* port = get_handle(handle_id);
+    if (!port || !port->is_port)
+        return ERR_BAD_HANDLE;
+    if (port->pending.empty())
+        return ERR_NO_MSG;
+    handle_t chan = port->pending.front();
+    port->pending.pop_front();
+    *peer_uuid = g_handles[chan]->peer_uuid;
+    return chan;
+}
+
+long close(uint32_t handle_id) {
+    std::lock_guard<std::mutex> lock(g_lock);
+    HostHandle* hh = get_handle(handle_id);
+    if (!hh)
+        return ERR_BAD_HANDLE;
+    HostHandle* peer = get_handle(hh->peer);
+    if (peer) {
+        peer->peer_closed = true;
+        peer->peer = INVALID_IPC_HANDLE;
+    }
+    g_handles[handle_id] = nullptr;
+    delete hh;
+    g_cond.notify_all();
+    return NO_ERROR;
+}
+
+long set_cookie(uint32_t handle, void* cookie) {
+    std::lock_guard<std::mutex> lock(g_lock);
+    HostHandle* hh = get_handle(handle);
+    if (!hh)
+        return ERR_BAD_HANDLE;
+    hh->cookie = cookie;
+    return NO_ERROR;
+}
+
+long wait(uint32_t handle_id, uevent_t* event, uint32_t timeout_msecs) {
+    std::unique_lock<std::mutex> lock(g_lock);
+    uint32_t ev = 0;
+    bool ok = wait_locked(lock, timeout_msecs, [&] {
+        HostHandle* hh = get_handle(handle_id);
+        if (!hh || g_shutdown)
+            return true;
+        ev = poll_handle(hh);
+        return ev != 0;
+    });
+    HostHandle* hh = get_handle(handle_id);
+    if (!hh)
+        return ERR_BAD_HANDLE;
+    if (g_shutdown)
+        return ERR_CHANNEL_CLOSED;
+    if (!ok)
+        return ERR_TIMED_OUT;
+    event->handle = handle_id;
+    event->event = ev;
+    event->cookie = hh->cookie;
+    return NO_ERROR;
+}
+
+long wait_any(uevent_t* event, uint32_t timeout_msecs) {
+    std::unique_lock<std::mutex> lock(g_lock);
+    bool ok = wait_locked(lock, timeout_msecs, [&] {
+        if (g_shutdown)
+            return true;
+        // Round-robin over TA handles so one busy channel cannot hide others.
+        size_t n = g_handles.size();
+        for (size_t i = 0; i < n; i++) {
+            size_t h = (g_next_poll + i) % n;
+            HostHandle* hh = g_handles[h];
+            if (!hh || hh->is_client)
+                continue;
+            uint32_t ev = poll_handle(hh);
+            if (ev) {
+                event->handle = (handle_t)h;
+                event->event = ev;
+                event->cookie = hh->cookie;
+                g_next_poll = h + 1;
+                return true;
+            }
+        }
+        return false;
+    });
+    if (g_shutdown)
+        return ERR_CHANNEL_CLOSED;
+    if (!ok)
+        return ERR_TIMED_OUT;
+    return NO_ERROR;
+}
+
+long get_msg(uint32_t handle, ipc_msg_info_t* msg_info) {
+    std::lock_guard<std::mutex> lock(g_lock);
+    HostHandle* hh = get_handle(handle);
+    if (!hh || hh->is_port)
+        return ERR_BAD_HANDLE;
+    for (HostMsg& m : hh->inbox) {
+        if (!m.retrieved) {
+            m.retrieved = true;
+            msg_info->id = m.id;
+            msg_info->len = m.data.size();
+            msg_info->num_handles = 0;
+            return NO_ERROR;
+        }
+    }
+    return ERR_NO_MSG;
+}
+
+long read_msg(uint32_t handle,
+              uint32_t msg_id,
+              uint32_t offset,
+              ipc_msg_t* msg) {
+    std::lock_guard<std::mutex> lock(g_lock);
+    HostHandle* hh = get_handle(handle);
+    if (!hh)
+        return ERR_BAD_HANDLE;
+    HostMsg* m = find_msg(hh, msg_id);
+    if (!m)
+        return ERR_INVALID_ARGS;
+    if (offset > m->data.size())
+        return ERR_INVALID_ARGS;
+    size_t copied = 0;
+    size_t remaining = m->data.size() - offset;
+    for (uint32_t i = 0; i < msg->num_iov && remaining; i++) {
+        size_t n = MIN(remaining, msg->iov[i].len);
+        memcpy(msg->iov[i].base, m->data.data() + offset + copied, n);
+        copied += n;
+        remaining -= n;
+    }
+    return copied;
+}
+
+long put_msg(uint32_t handle, uint32_t msg_id) {
+    std::lock_guard<std::mutex> lock(g_lock);
+    HostHandle* hh = get_handle(handle);
+    if (!hh)
+        return ERR_BAD_HANDLE;
+    for (auto it = hh->inbox.begin(); it != hh->inbox.end(); ++it) {
+        if (it->id == msg_id) {
+            hh->inbox.erase(it);
+            g_cond.notify_all();
+            return NO_ERROR;
+        }
+    }
+    return ERR_INVALID_ARGS;
+}
+
+long send_msg(uint32_t handle, ipc_msg_t* msg) {
+    std::lock_guard<std::mutex> lock(g_lock);
+    HostHandle* hh = get_handle(handle);
+    if (!hh || hh->is_port)
+        return ERR_BAD_HANDLE;
+    HostHandle* peer = get_handle(hh->peer);
+    if (!peer)
+        return ERR_CHANNEL_CLOSED;
+    if (peer->inbox.size() >= kClientRecvBufs) {
+        hh->send_blocked = true;
+        return ERR_NOT_ENOUGH_BUFFER;
+    }
+    return queue_msg(peer, msg);
+}
+
+long gettime(uint32_t clock_id, uint32_t flags, int64_t* time) {
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
+        return ERR_GENERIC;
+    *time = (int64_t)ts.tv_sec * 1000 * 1000 * 1000 + ts.tv_nsec;
+    return NO_ERROR;
+}
+
+int memcpy_s(void* dest, size_t destsz, const void* src, size_t count) {
+    if (!dest || !src || count > destsz)
+        return ERR_INVALID_ARGS;
+    memcpy(dest, src, count);
+    return NO_ERROR;
+}
+
+int get_device_info(trusty_device_info_t* dev_info) {
+    // There is no CSE on the host; keybox provisioning must pass the keybox
+    // in the request.
+    return ERR_NOT_SUPPORTED;
+}
+
+}  // extern "C"
+
+long host_ipc_connect(const char* port, const uuid_t* peer_uuid) {
+    std::unique_lock<std::mutex> lock(g_lock);
+    g_cond.wait(lock, [&] { return g_shutdown || find_port(port); });
+    if (g_shutdown)
+        return ERR_CHANNEL_CLOSED;
+    HostHandle* p = find_port(port);
+
+    HostHandle* client = new HostHandle;
+    client->is_client = true;
+    HostHandle* server = new HostHandle;
+    server->peer_uuid = *peer_uuid;
+    server->num_recv_bufs_chan = p->num_recv_bufs;
+
+    handle_t c = new_handle(client);
+    handle_t s = new_handle(server);
+    client->peer = s;
+    server->peer = c;
+    p->pending.push_back(s);
+    g_cond.notify_all();
+    return c;
+}
+
+long host_ipc_send(handle_t chan, const void* buf, size_t len) {
+    std::unique_lock<std::mutex> lock(g_lock);
+    g_cond.wait(lock, [&] {
+        HostHandle* hh = get_handle(chan);
+        HostHandle* peer = hh ? get_handle(hh->peer) : nullptr;
+        return g_shutdown || !peer ||
+               peer->inbox.size() < peer->num_recv_bufs_chan;
+    });
+    HostHandle* hh = get_handle(chan);
+    HostHandle* peer = hh ? get_handle(hh->peer) : nullptr;
+    if (g_shutdown || !peer)
+        return ERR_CHANNEL_CLOSED;
+    iovec_t iov = {const_cast<void*>(buf), len};
+    ipc_msg_t msg = {1, &iov, 0, nullptr};
+    return queue_msg(peer, &msg);
+}
+
+long host_ipc_recv(handle_t chan, void* buf, size_t len) {
+    std::unique_lock<std::mutex> lock(g_lock);
+    g_cond.wait(lock, [&] {
+        HostHandle* hh = get_handle(chan);
+        return g_shutdown || !hh || !hh->inbox.empty() || hh->peer_closed;
+    });
+    HostHandle* hh = get_handle(chan);
+    if (!hh || g_shutdown)
+        return ERR_CHANNEL_CLOSED;
+    if (hh->inbox.empty())
+        return ERR_CHANNEL_CLOSED;
+
+    HostMsg m = std::move(hh->inbox.front());
+    hh->inbox.pop_front();
+    memcpy(buf, m.data.data(), MIN(len, m.data.size()));
+
+    HostHandle* peer = get_handle(hh->peer);
+    if (peer && peer->send_blocked) {
+        peer->send_blocked = false;
+        peer->send_unblocked = true;
+    }
+    g_cond.notify_all();
+    return m.data.size();
+}
+
+void host_ipc_close(handle_t chan) {
+    close(chan);
+}
+
+void host_ipc_shutdown(void) {
+    std::lock_guard<std::mutex> lock(g_lock);
+    g_shutdown = true;
+    g_cond.notify_all();
+}
@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "command_stats.h"
+
+#include <string.h>
+
+namespace keymaster {
+
+void CommandStats::Record(uint64_t request_bytes,
+                          uint64_t response_bytes,
+                          uint64_t latency_us,
+                          bool error) {
+    counters_.calls++;
+    if (error)
+        counters_.errors++;
+    counters_.request_bytes += request_bytes;
+    counters_.response_bytes += response_bytes;
+    counters_.total_latency_us += latency_us;
+    counters_.latency_hist[LatencyBucket(latency_us)]++;
+}
+
+void CommandStats::Reset() {
+    memset(&counters_, 0, sizeof(counters_));
+}
+
+void CommandStats::Export(uint32_t cmd, keymaster_command_stats* out) const {
+    *out = counters_;
+    out->cmd = cmd;
+}
+
+size_t CommandStats::LatencyBucket(uint64_t latency_us) {
+    size_t bucket = 0;
+    while (latency_us >= 2 && bucket < KEYMASTER_STATS_LATENCY_BUCKETS - 1) {
+        latency_us >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+}  // namespace keymaster
@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "keymaster_ipc.h"
+
+namespace keymaster {
+
+/*
+ * Call, error, byte and latency counters of one command, in the layout they
+ * are reported in by KM_GET_STATS.
+ */
+class CommandStats {
+public:
+    CommandStats() { Reset(); }
+
+    /*
+     * Accounts for one request of |request_bytes| answered with
+     * |response_bytes| after |latency_us| microseconds.
+     */
+    void Record(uint64_t request_bytes,
+                uint64_t response_bytes,
+                uint64_t latency_us,
+                bool error);
+
+    void Reset();
+
+    /*
+     * Copies the counters into |out|, tagged with |cmd|.
+     */
+    void Export(uint32_t cmd, keymaster_command_stats* out) const;
+
+    uint32_t calls() const { return counters_.calls; }
+
+    /*
+     * Returns the latency_hist index for a call that took |latency_us|.
+     */
+    static size_t LatencyBucket(uint64_t latency_us);
+
+private:
+    keymaster_command_stats counters_;
+};
+
+}  // namespace keymaster
@@ -17,6 +17,7 @@
 #include "keymaster_ipc.h"
 
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -27,6 +28,8 @@
 
 #include <keymaster/UniquePtr.h>
 
+#include "command_stats.h"
+#include "message_arena.h"
 #include "trusty_keymaster.h"
 #include "trusty_logger.h"
 #include <trusty_std.h>
@@ -52,8 +55,43 @@ struct keymaster_chan_ctx {
     long (*dispatch)(keymaster_chan_ctx*,
                      keymaster_message*,
                      uint32_t,
-                     keymaster::UniquePtr<uint8_t[]>*,
-                     uint32_t*);
+                     MessageArena*);
+    // Largest message exchanged on this channel, as agreed through
+    // KM_GET_VERSION.
+    uint32_t max_msg_size = KEYMASTER_MAX_BUFFER_LENGTH;
+    // Incoming messages are read here rather than into a fresh allocation, so
+    // steady-state request handling does not churn the TA heap. It holds
+    // max_msg_size bytes plus a null-terminator.
+    keymaster::UniquePtr<uint8_t[]> recv_buf;
+    // Receive buffer for a newly agreed message size, swapped in once the
+    // KM_GET_VERSION reply that announces the size has been sent.
+    keymaster::UniquePtr<uint8_t[]> next_recv_buf;
+    uint32_t next_max_msg_size = 0;
+    // Responses are serialized here and wiped once they have been sent.
+    MessageArena response;
+    // A request arriving as KM_REQUEST_FRAGMENT messages is collected here
+    // behind a keymaster_message header, filled in from the final message.
+    MessageArena request;
+    // Set when the request being reassembled had to be dropped.
+    long request_error = NO_ERROR;
+    // Response messages waiting for room in the client's receive buffers.
+    MessageArena outbound;
+    // The oldest unhandled message, read ahead into recv_buf so the scheduler
+    // knows its keymaster_cost before giving the channel a turn.
+    bool has_next_msg = false;
+    uint32_t next_msg_id;
+    uint32_t next_msg_len;
+    uint8_t next_cost;
+    // Messages taken off the channel while it was waiting for a turn or its
+    // outbound queue was backed up, oldest first. Taking them keeps
+    // IPC_HANDLE_POLL_MSG from firing again until the client sends more.
+    ipc_msg_info_t held_msgs[KEYMASTER_MAX_IN_FLIGHT];
+    uint32_t num_held_msgs = 0;
+    // Connected to the secure (gatekeeper) port.
+    bool secure = false;
+    // Queued for a turn of the scheduler, linked through next_scheduled.
+    bool scheduled = false;
+    keymaster_chan_ctx* next_scheduled = NULL;
 };
 
 struct keymaster_srv_ctx {
@@ -63,6 +101,7 @@ struct keymaster_srv_ctx {
 
 static void keymaster_port_handler_secure(const uevent_t* ev, void* priv);
 static void keymaster_port_handler_non_secure(const uevent_t* ev, void* priv);
+static void dispatch_event(const uevent_t* ev);
 
 static tipc_event_handler keymaster_port_evt_handler_secure = {
         .proc = keymaster_port_handler_secure,
@@ -106,59 +145,114 @@ static long handle_port_errors(const uevent_t* ev) {
     return NO_ERROR;
 }
 
-static int wait_to_send(handle_t session, struct ipc_msg* msg) {
-    int rc;
-    struct uevent ev = UEVENT_INITIAL_VALUE(ev);
-
-    rc = wait(session, &ev, -1);
-    if (rc < 0) {
-        LOG_E("failed to wait for outgoing queue to free up\n", 0);
-        return rc;
+/*
+ * Sends as much of ctx->outbound as the client has room for. Whatever does not
+ * fit stays queued until the next IPC_HANDLE_POLL_SEND_UNBLOCKED event.
+ */
+static long flush_outbound(keymaster_chan_ctx* ctx) {
+    MessageArena* queue = &ctx->outbound;
+    size_t pos = 0;
+    long rc = NO_ERROR;
+
+    while (pos < queue->size()) {
+        uint32_t size;
+        memcpy(&size, queue->data() + pos, sizeof(size));
+        iovec_t iov = {queue->data() + pos + sizeof(size), size};
+        ipc_msg_t msg = {1, &iov, 0, NULL};
+        rc = send_msg(ctx->chan, &msg);
+        if (rc == ERR_NOT_ENOUGH_BUFFER) {
+            rc = NO_ERROR;
+            break;
+        }
+        if (rc < 0) {
+            LOG_E("failed (%d) to send_msg for chan (%d)", rc, ctx->chan);
+            break;
+        }
+        rc = NO_ERROR;
+        pos += sizeof(size) + size;
     }
 
-    if (ev.event & IPC_HANDLE_POLL_SEND_UNBLOCKED) {
-        return send_msg(session, msg);
+    queue->Consume(pos);
+    if (queue->size() == 0) {
+        queue->Shrink(KEYMASTER_MESSAGE_ARENA_RETAIN_BYTES);
     }
+    return rc;
+}
 
-    if (ev.event & IPC_HANDLE_POLL_MSG) {
-        return ERR_BUSY;
+/*
+ * Adds a message made of |hdr| and |size| bytes of |buf| to the end of
+ * ctx->outbound, each entry being a uint32_t size followed by the message.
+ *
+ * The queue is not capped. No further requests are taken from a channel
+ * while its queue is not empty, so it only ever holds the unsent rest of one
+ * response, which can be as large as any response the TA produces. A client
+ * that stops reading is held back rather than closed.
+ */
+static long queue_outbound(keymaster_chan_ctx* ctx,
+                           const keymaster_message* hdr,
+                           const uint8_t* buf,
+                           uint32_t size) {
+    uint32_t msg_size = sizeof(*hdr) + size;
+    uint8_t* dst = ctx->outbound.Append(sizeof(msg_size) + msg_size);
+    if (dst == NULL) {
+        return ERR_NO_MEMORY;
     }
+    memcpy(dst, &msg_size, sizeof(msg_size));
+    memcpy(dst + sizeof(msg_size), hdr, sizeof(*hdr));
+    memcpy(dst + sizeof(msg_size) + sizeof(*hdr), buf, size);
+    return NO_ERROR;
+}
+
+// Room left in each response message beyond the payload.
+static const uint32_t kResponseHeadroom = 64;
 
-    if (ev.event & IPC_HANDLE_POLL_HUP) {
-        return ERR_CHANNEL_CLOSED;
+/*
+ * Sends one response message, or queues it on the channel if the client's
+ * receive buffers are full or earlier messages are still queued, so that a
+ * slow client never holds up the rest of the TA.
+ */
+static long send_chunk(keymaster_chan_ctx* ctx,
+                       uint32_t cmd,
+                       uint8_t* buf,
+                       uint32_t size,
+                       bool last) {
+    struct keymaster_message km_msg;
+    km_msg.cmd = cmd | KEYMASTER_RESP_BIT;
+    if (last) {
+        km_msg.cmd = km_msg.cmd | KEYMASTER_STOP_BIT;
     }
 
-    return rc;
+    if (ctx->outbound.size() == 0) {
+        iovec_t iov[2] = {{&km_msg, sizeof(km_msg)}, {buf, size}};
+        ipc_msg_t msg = {2, iov, 0, NULL};
+        long rc = send_msg(ctx->chan, &msg);
+        if (rc != ERR_NOT_ENOUGH_BUFFER) {
+            // fatal error
+            if (rc < 0) {
+                LOG_E("failed (%d) to send_msg for chan (%d)", rc, ctx->chan);
+                return rc;
+            }
+            return NO_ERROR;
+        }
+    }
+    return queue_outbound(ctx, &km_msg, buf, size);
 }
 
-static long send_response(handle_t chan,
+static long send_response(keymaster_chan_ctx* ctx,
                           uint32_t cmd,
                           uint8_t* out_buf,
-                          uint32_t out_buf_size) {
-    struct keymaster_message km_msg;
-    km_msg.cmd = cmd | KEYMASTER_RESP_BIT;
-    iovec_t iov[2] = {{&km_msg, sizeof(km_msg)}, {nullptr, 0}};
-    ipc_msg_t msg = {2, iov, 0, NULL};
+                          uint32_t out_buf_size,
+                          uint32_t max_msg_size) {
+    uint32_t max_chunk_size = max_msg_size - kResponseHeadroom;
     uint32_t msg_size;
     uint32_t bytes_remaining = out_buf_size;
     uint32_t bytes_sent = 0;
-    uint32_t max_msg_size = KEYMASTER_MAX_BUFFER_LENGTH - 64;
 
     do {
-        msg_size = MIN(max_msg_size, bytes_remaining);
-        if (msg_size == bytes_remaining) {
-            km_msg.cmd = km_msg.cmd | KEYMASTER_STOP_BIT;
-        }
-        iov[1] = {out_buf + bytes_sent, msg_size};
-
-        long rc = send_msg(chan, &msg);
-        if (rc == ERR_NOT_ENOUGH_BUFFER) {
-            rc = wait_to_send(chan, &msg);
-        }
-
-        // fatal error
+        msg_size = MIN(max_chunk_size, bytes_remaining);
+        long rc = send_chunk(ctx, cmd, out_buf + bytes_sent, msg_size,
+                             msg_size == bytes_remaining);
         if (rc < 0) {
-            LOG_E("failed (%d) to send_msg for chan (%d)", rc, chan);
             return rc;
         }
         bytes_remaining -= msg_size;
@@ -168,11 +262,95 @@ static long send_response(handle_t chan,
     return NO_ERROR;
 }
 
-static long send_error_response(handle_t chan,
+/*
+ * Writes a response to the channel as it is produced. Bytes collect in |buf|
+ * until a full message's worth is pending, which is then sent. The last
+ * message is only known once Finish() is called, so one full chunk is always
+ * held back until more data arrives.
+ */
+class ChunkedResponseWriter {
+public:
+    ChunkedResponseWriter(keymaster_chan_ctx* ctx,
+                          uint32_t cmd,
+                          uint32_t max_msg_size,
+                          MessageArena* buf)
+            : ctx_(ctx),
+              cmd_(cmd),
+              max_chunk_size_(max_msg_size - kResponseHeadroom),
+              buf_(buf) {}
+
+    bool Write(const void* data, size_t size) {
+        const uint8_t* pos = reinterpret_cast<const uint8_t*>(data);
+        while (size) {
+            if (buf_->size() == max_chunk_size_ && !Flush(false)) {
+                return false;
+            }
+            size_t n = MIN(size, max_chunk_size_ - buf_->size());
+            uint8_t* dst = buf_->Append(n);
+            if (dst == NULL) {
+                error_ = ERR_NO_MEMORY;
+                return false;
+            }
+            memcpy(dst, pos, n);
+            pos += n;
+            size -= n;
+            bytes_written_ += n;
+        }
+        return true;
+    }
+
+    bool WriteUint32(uint32_t value) { return Write(&value, sizeof(value)); }
+
+    /* Same layout as append_size_and_data_to_buf. */
+    bool WriteBlob(const uint8_t* data, size_t size) {
+        return WriteUint32(size) && Write(data, size);
+    }
+
+    long Finish() {
+        Flush(true);
+        return error_;
+    }
+
+    long error() const { return error_; }
+
+    // True once any part of the response has gone out; from then on the
+    // client can no longer be sent an error response instead.
+    bool sent() const { return sent_; }
+
+    size_t bytes_written() const { return bytes_written_; }
+
+private:
+    bool Flush(bool last) {
+        long rc = send_chunk(ctx_, cmd_, buf_->data(), buf_->size(), last);
+        buf_->Reset();
+        sent_ = true;
+        if (rc < 0) {
+            error_ = rc;
+            return false;
+        }
+        return true;
+    }
+
+    keymaster_chan_ctx* ctx_;
+    uint32_t cmd_;
+    uint32_t max_chunk_size_;
+    MessageArena* buf_;
+    long error_ = NO_ERROR;
+    bool sent_ = false;
+    size_t bytes_written_ = 0;
+};
+
+// Writer for the reply to the top-level message being handled.
+static ChunkedResponseWriter* response_stream;
+
+// Keymaster error of the last response produced by do_dispatch.
+static keymaster_error_t dispatch_error = KM_ERROR_OK;
+
+static long send_error_response(keymaster_chan_ctx* ctx,
                                 uint32_t cmd,
                                 keymaster_error_t err) {
-    return send_response(chan, cmd, reinterpret_cast<uint8_t*>(&err),
-                         sizeof(err));
+    return send_response(ctx, cmd, reinterpret_cast<uint8_t*>(&err),
+                         sizeof(err), KEYMASTER_MAX_BUFFER_LENGTH);
 }
 
 /*
@@ -194,29 +372,68 @@ static long deserialize_request(struct keymaster_message* msg,
 }
 
 template <typename Response>
-static long serialize_response(Response& rsp,
-                               keymaster::UniquePtr<uint8_t[]>* out,
-                               uint32_t* out_size) {
+static long serialize_response(Response& rsp, MessageArena* out) {
     rsp.message_version = message_version;
-    *out_size = rsp.SerializedSize();
+    size_t size = rsp.SerializedSize();
 
-    out->reset(new uint8_t[*out_size]);
-    if (out->get() == NULL) {
-        *out_size = 0;
+    uint8_t* buf = out->Append(size);
+    if (buf == NULL) {
         return ERR_NO_MEMORY;
     }
 
-    rsp.Serialize(out->get(), out->get() + *out_size);
+    rsp.Serialize(buf, buf + size);
 
     return NO_ERROR;
 }
 
+/*
+ * AttestKey and ExportKey replies can span several messages, so they are
+ * written straight to the channel through response_stream rather than
+ * serialized in one piece. The bytes match their Serialize() methods. There
+ * is no stream inside a KM_BATCH, where each reply has to stay in the arena
+ * to be packed with the others.
+ */
+static bool can_stream_response(const KeymasterResponse& rsp) {
+    return response_stream != NULL && rsp.error == KM_ERROR_OK;
+}
+
+static long serialize_response(AttestKeyResponse& rsp, MessageArena* out) {
+    if (!can_stream_response(rsp)) {
+        return serialize_response<AttestKeyResponse>(rsp, out);
+    }
+
+    ChunkedResponseWriter* writer = response_stream;
+    const keymaster_cert_chain_t& chain = rsp.certificate_chain;
+    bool ok = writer->WriteUint32(rsp.error) &&
+              writer->WriteUint32(chain.entry_count);
+    for (size_t i = 0; ok && i < chain.entry_count; i++) {
+        ok = writer->WriteBlob(chain.entries[i].data,
+                               chain.entries[i].data_length);
+    }
+    if (!ok) {
+        return writer->error();
+    }
+    return writer->Finish();
+}
+
+static long serialize_response(ExportKeyResponse& rsp, MessageArena* out) {
+    if (!can_stream_response(rsp)) {
+        return serialize_response<ExportKeyResponse>(rsp, out);
+    }
+
+    ChunkedResponseWriter* writer = response_stream;
+    if (!writer->WriteUint32(rsp.error) ||
+        !writer->WriteBlob(rsp.key_data, rsp.key_data_length)) {
+        return writer->error();
+    }
+    return writer->Finish();
+}
+
 template <typename Keymaster, typename Request, typename Response>
 static long do_dispatch(void (Keymaster::*operation)(const Request&, Response*),
                         struct keymaster_message* msg,
                         uint32_t payload_size,
-                        keymaster::UniquePtr<uint8_t[]>* out,
-                        uint32_t* out_size) {
+                        MessageArena* out) {
     status_t err;
     Request req;
 
@@ -230,8 +447,9 @@ static long do_dispatch(void (Keymaster::*operation)(const Request&, Response*),
     if (msg->cmd == KM_CONFIGURE) {
         device->set_configure_error(rsp.error);
     }
+    dispatch_error = rsp.error;
 
-    err = serialize_response(rsp, out, out_size);
+    err = serialize_response(rsp, out);
     if (err != NO_ERROR) {
         LOG_E("Error serializing response", 0);
         return err;
@@ -249,8 +467,7 @@ template <typename Keymaster, typename Request, typename Response>
 static long do_dispatch(Response (Keymaster::*operation)(const Request&),
                         struct keymaster_message* msg,
                         uint32_t payload_size,
-                        keymaster::UniquePtr<uint8_t[]>* out,
-                        uint32_t* out_size) {
+                        MessageArena* out) {
     status_t err;
     Request req;
 
@@ -263,8 +480,9 @@ static long do_dispatch(Response (Keymaster::*operation)(const Request&),
     if (msg->cmd == KM_CONFIGURE) {
         device->set_configure_error(rsp.error);
     }
+    dispatch_error = rsp.error;
 
-    err = serialize_response(rsp, out, out_size);
+    err = serialize_response(rsp, out);
     if (err != NO_ERROR)
         return err;
 
@@ -279,24 +497,23 @@ template <typename Keymaster, typename Response>
 static long do_dispatch(Response (Keymaster::*operation)(),
                         struct keymaster_message* msg,
                         uint32_t payload_size,
-                        keymaster::UniquePtr<uint8_t[]>* out,
-                        uint32_t* out_size) {
+                        MessageArena* out) {
     status_t err;
     Response rsp = ((device->*operation)());
 
     if (msg->cmd == KM_CONFIGURE) {
         device->set_configure_error(rsp.error);
     }
+    dispatch_error = rsp.error;
 
-    err = serialize_response(rsp, out, out_size);
+    err = serialize_response(rsp, out);
     if (err != NO_ERROR)
         return err;
 
     return NO_ERROR;
 }
 
-static long get_auth_token_key(keymaster::UniquePtr<uint8_t[]>* key_buf,
-                               uint32_t* key_size) {
+static long get_auth_token_key(MessageArena* out) {
     keymaster_key_blob_t key;
     long rc = device->GetAuthTokenKey(&key);
 
@@ -308,257 +525,744 @@ static long get_auth_token_key(keymaster::UniquePtr<uint8_t[]>* key_buf,
         return ERR_NOT_ENOUGH_BUFFER;
     }
 
-    key_buf->reset(new uint8_t[key.key_material_size]);
-    if (key_buf->get() == NULL) {
+    uint8_t* key_buf = out->Append(key.key_material_size);
+    if (key_buf == NULL) {
         return ERR_NO_MEMORY;
     }
 
-    *key_size = key.key_material_size;
-
-    memcpy(key_buf->get(), key.key_material, key.key_material_size);
+    memcpy(key_buf, key.key_material, key.key_material_size);
     return NO_ERROR;
 }
 
 static long keymaster_dispatch_secure(keymaster_chan_ctx* ctx,
                                       keymaster_message* msg,
                                       uint32_t payload_size,
-                                      keymaster::UniquePtr<uint8_t[]>* out,
-                                      uint32_t* out_size) {
+                                      MessageArena* out) {
     switch (msg->cmd) {
     case KM_GET_AUTH_TOKEN_KEY:
-        return get_auth_token_key(out, out_size);
+        return get_auth_token_key(out);
     default:
         return ERR_NOT_IMPLEMENTED;
     }
 }
 
-// Returns true if |cmd| is called from the bootloader
-static bool cmd_is_from_bootloader(uint32_t cmd) {
-    return (cmd == KM_SET_BOOT_PARAMS || cmd == KM_SET_ATTESTATION_KEY ||
-            cmd == KM_APPEND_ATTESTATION_CERT_CHAIN ||
-            cmd == KM_ATAP_GET_CA_REQUEST ||
-            cmd == KM_ATAP_SET_CA_RESPONSE_BEGIN ||
-            cmd == KM_ATAP_SET_CA_RESPONSE_UPDATE ||
-            cmd == KM_ATAP_SET_CA_RESPONSE_FINISH || cmd == KM_ATAP_READ_UUID ||
-            cmd == KM_SET_PRODUCT_ID);
+static bool cmd_takes_op_handle(uint32_t cmd) {
+    return cmd == KM_UPDATE_OPERATION || cmd == KM_FINISH_OPERATION ||
+           cmd == KM_ABORT_OPERATION;
+}
+
+/*
+ * Runs each sub-command of a KM_BATCH message through the channel's regular
+ * dispatcher, which appends its response to |out| right after the entry
+ * header reserved for it. The layout is described with keymaster_batch_entry.
+ */
+static long dispatch_batch(keymaster_chan_ctx* ctx,
+                           keymaster_message* msg,
+                           uint32_t payload_size,
+                           MessageArena* out) {
+    uint8_t* pos = msg->payload;
+    uint8_t* end = msg->payload + payload_size;
+    uint32_t count = 0;
+    keymaster_operation_handle_t last_op_handle = 0;
+
+    while (pos < end) {
+        keymaster_batch_entry entry;
+        if (count == KEYMASTER_MAX_BATCH_ENTRIES ||
+            (size_t)(end - pos) < sizeof(entry)) {
+            LOG_E("malformed batch at entry %d", count);
+            return ERR_NOT_VALID;
+        }
+        memcpy(&entry, pos, sizeof(entry));
+        if (entry.payload_size > (size_t)(end - pos) - sizeof(entry)) {
+            LOG_E("malformed batch at entry %d", count);
+            return ERR_NOT_VALID;
+        }
+
+        keymaster_message* sub_msg = reinterpret_cast<keymaster_message*>(
+                pos + offsetof(keymaster_batch_entry, cmd));
+        if (cmd_takes_op_handle(entry.cmd) && last_op_handle &&
+            entry.payload_size >= sizeof(last_op_handle)) {
+            keymaster_operation_handle_t op_handle;
+            memcpy(&op_handle, sub_msg->payload, sizeof(op_handle));
+            if (op_handle == 0) {
+                memcpy(sub_msg->payload, &last_op_handle,
+                       sizeof(last_op_handle));
+            }
+        }
+
+        // The arena may move as responses are appended, so track offsets.
+        size_t header_offset = out->size();
+        if (out->Append(sizeof(keymaster_batch_entry)) == NULL) {
+            return ERR_NO_MEMORY;
+        }
+        size_t rsp_offset = out->size();
+
+        long rc = ERR_NOT_VALID;
+        if (entry.cmd != KM_BATCH) {
+            rc = ctx->dispatch(ctx, sub_msg, entry.payload_size, out);
+        }
+        if (rc < 0) {
+            keymaster_error_t err = rc == ERR_NOT_CONFIGURED
+                                            ? device->get_configure_error()
+                                            : KM_ERROR_UNKNOWN_ERROR;
+            out->Truncate(rsp_offset);
+            uint8_t* err_buf = out->Append(sizeof(err));
+            if (err_buf == NULL) {
+                return ERR_NO_MEMORY;
+            }
+            memcpy(err_buf, &err, sizeof(err));
+        } else if (entry.cmd == KM_BEGIN_OPERATION) {
+            BeginOperationResponse rsp(message_version);
+            const uint8_t* p = out->data() + rsp_offset;
+            if (rsp.Deserialize(&p, out->data() + out->size()) &&
+                rsp.error == KM_ERROR_OK) {
+                last_op_handle = rsp.op_handle;
+            }
+        }
+
+        keymaster_batch_entry rsp_entry = {
+                (uint32_t)(out->size() - rsp_offset),
+                entry.cmd | KEYMASTER_RESP_BIT};
+        memcpy(out->data() + header_offset, &rsp_entry, sizeof(rsp_entry));
+
+        pos += sizeof(entry) + entry.payload_size;
+        count++;
+    }
+
+    return NO_ERROR;
 }
 
-// Returns true if |cmd| can be used before the configure command
-static bool cmd_allowed_before_configure(uint32_t cmd) {
-    return cmd == KM_CONFIGURE || cmd == KM_GET_VERSION ||
-           cmd_is_from_bootloader(cmd);
+/*
+ * Answers KM_GET_VERSION and, when the request carries one, settles the
+ * message size for the channel as described in keymaster_ipc.h. The new size
+ * takes effect after this reply has been sent.
+ */
+static long dispatch_get_version(keymaster_chan_ctx* ctx,
+                                 keymaster_message* msg,
+                                 uint32_t payload_size,
+                                 MessageArena* out) {
+    long rc = do_dispatch(&TrustyKeymaster::GetVersion, msg, payload_size, out);
+    if (rc < 0 || payload_size < sizeof(uint32_t)) {
+        return rc;
+    }
+
+    uint32_t max_msg_size;
+    memcpy(&max_msg_size, msg->payload, sizeof(max_msg_size));
+    max_msg_size = MIN(max_msg_size, KEYMASTER_MAX_MESSAGE_SIZE);
+    max_msg_size = MAX(max_msg_size, KEYMASTER_MAX_BUFFER_LENGTH);
+
+    if (max_msg_size == ctx->max_msg_size) {
+        // Drop a different size announced earlier in the same batch.
+        ctx->next_recv_buf.reset();
+        ctx->next_max_msg_size = 0;
+    } else {
+        ctx->next_recv_buf.reset(new uint8_t[max_msg_size + 1]);
+        if (ctx->next_recv_buf.get() == NULL) {
+            LOG_E("no memory for %d-byte messages", max_msg_size);
+            max_msg_size = ctx->max_msg_size;
+            ctx->next_max_msg_size = 0;
+        } else {
+            ctx->next_max_msg_size = max_msg_size;
+        }
+    }
+
+    uint8_t* buf = out->Append(sizeof(max_msg_size));
+    if (buf == NULL) {
+        ctx->next_recv_buf.reset();
+        ctx->next_max_msg_size = 0;
+        return ERR_NO_MEMORY;
+    }
+    memcpy(buf, &max_msg_size, sizeof(max_msg_size));
+    return NO_ERROR;
+}
+
+/*
+ * Lifecycle phases of the TA, as far as the non-secure port is concerned.
+ * Each command lists the phases it may run in.
+ */
+enum keymaster_phase : uint8_t {
+    KM_PHASE_UNCONFIGURED = 1 << 0, /* before KM_CONFIGURE */
+    KM_PHASE_CONFIGURED = 1 << 1,   /* after a successful KM_CONFIGURE */
+    KM_PHASE_FAILED = 1 << 2,       /* after KM_CONFIGURE failed */
+};
+
+static const uint8_t KM_PHASE_BOOTLOADER = KM_PHASE_UNCONFIGURED;
+static const uint8_t KM_PHASE_ANY =
+        KM_PHASE_UNCONFIGURED | KM_PHASE_CONFIGURED | KM_PHASE_FAILED;
+
+/*
+ * Rough cost of a command: cheap commands answer from memory or do symmetric
+ * crypto, expensive ones may run asymmetric key operations or touch storage.
+ * KM_UPDATE_OPERATION and KM_FINISH_OPERATION depend on the operation, so
+ * message_cost() classifies them per request and their table costs are unused.
+ */
+enum keymaster_cost : uint8_t {
+    KM_COST_CHEAP,
+    KM_COST_EXPENSIVE,
+};
+
+typedef long (*keymaster_handler_t)(keymaster_chan_ctx*,
+                                    keymaster_message*,
+                                    uint32_t,
+                                    MessageArena*);
+
+static long dispatch_get_stats(keymaster_chan_ctx* ctx,
+                               keymaster_message* msg,
+                               uint32_t payload_size,
+                               MessageArena* out);
+
+/*
+ * keymaster_command_info - Dispatch table entry for one command
+ * @cmd: the command, one of keymaster_command
+ * @name: command name for logs
+ * @handler: runs the command; NULL for unused slots in the tables
+ * @phases: mask of keymaster_phase values the command is accepted in
+ * @cost: keymaster_cost of the command
+ */
+struct keymaster_command_info {
+    uint32_t cmd;
+    const char* name;
+    keymaster_handler_t handler;
+    uint8_t phases;
+    uint8_t cost;
+};
+
+template <typename Method, Method method>
+static long dispatch_method(keymaster_chan_ctx* ctx,
+                            keymaster_message* msg,
+                            uint32_t payload_size,
+                            MessageArena* out) {
+    return do_dispatch(method, msg, payload_size, out);
+}
+
+#define KM_METHOD(name)                                           \
+    &dispatch_method<decltype(&TrustyKeymaster::name), \
+                     &TrustyKeymaster::name>
+
+#define KM_COMMAND(cmd, handler, phases, cost) \
+    { cmd, #cmd, handler, phases, cost }
+
+#define KM_NO_COMMAND \
+    { 0, NULL, NULL, 0, 0 }
+
+/* Indexed by cmd >> KEYMASTER_REQ_SHIFT. */
+static constexpr keymaster_command_info kStandardCommands[] = {
+        KM_COMMAND(KM_GENERATE_KEY, KM_METHOD(GenerateKey),
+                   KM_PHASE_CONFIGURED, KM_COST_EXPENSIVE),
+        KM_COMMAND(KM_BEGIN_OPERATION, KM_METHOD(BeginOperation),
+                   KM_PHASE_CONFIGURED, KM_COST_CHEAP),
+        KM_COMMAND(KM_UPDATE_OPERATION, KM_METHOD(UpdateOperation),
+                   KM_PHASE_CONFIGURED, KM_COST_CHEAP),
+        KM_COMMAND(KM_FINISH_OPERATION, KM_METHOD(FinishOperation),
+                   KM_PHASE_CONFIGURED, KM_COST_EXPENSIVE),
+        KM_COMMAND(KM_ABORT_OPERATION, KM_METHOD(AbortOperation),
+                   KM_PHASE_CONFIGURED, KM_COST_CHEAP),
+        KM_COMMAND(KM_IMPORT_KEY, KM_METHOD(ImportKey), KM_PHASE_CONFIGURED,
+                   KM_COST_EXPENSIVE),
+        KM_COMMAND(KM_EXPORT_KEY, KM_METHOD(ExportKey), KM_PHASE_CONFIGURED,
+                   KM_COST_CHEAP),
+        KM_COMMAND(KM_GET_VERSION, &dispatch_get_version, KM_PHASE_ANY,
+                   KM_COST_CHEAP),
+        KM_COMMAND(KM_ADD_RNG_ENTROPY, KM_METHOD(AddRngEntropy),
+                   KM_PHASE_CONFIGURED, KM_COST_CHEAP),
+        KM_COMMAND(KM_GET_SUPPORTED_ALGORITHMS, KM_METHOD(SupportedAlgorithms),
+                   KM_PHASE_CONFIGURED, KM_COST_CHEAP),
+        KM_COMMAND(KM_GET_SUPPORTED_BLOCK_MODES,
+                   KM_METHOD(SupportedBlockModes), KM_PHASE_CONFIGURED,
+                   KM_COST_CHEAP),
+        KM_COMMAND(KM_GET_SUPPORTED_PADDING_MODES,
+                   KM_METHOD(SupportedPaddingModes), KM_PHASE_CONFIGURED,
+                   KM_COST_CHEAP),
+        KM_COMMAND(KM_GET_SUPPORTED_DIGESTS, KM_METHOD(SupportedDigests),
+                   KM_PHASE_CONFIGURED, KM_COST_CHEAP),
+        KM_COMMAND(KM_GET_SUPPORTED_IMPORT_FORMATS,
+                   KM_METHOD(SupportedImportFormats), KM_PHASE_CONFIGURED,
+                   KM_COST_CHEAP),
+        KM_COMMAND(KM_GET_SUPPORTED_EXPORT_FORMATS,
+                   KM_METHOD(SupportedExportFormats), KM_PHASE_CONFIGURED,
+                   KM_COST_CHEAP),
+        KM_COMMAND(KM_GET_KEY_CHARACTERISTICS,
+                   KM_METHOD(GetKeyCharacteristics), KM_PHASE_CONFIGURED,
+                   KM_COST_CHEAP),
+        KM_COMMAND(KM_ATTEST_KEY, KM_METHOD(AttestKey), KM_PHASE_CONFIGURED,
+                   KM_COST_EXPENSIVE),
+        KM_COMMAND(KM_UPGRADE_KEY, KM_METHOD(UpgradeKey), KM_PHASE_CONFIGURED,
+                   KM_COST_EXPENSIVE),
+        KM_COMMAND(KM_CONFIGURE, KM_METHOD(Configure),
+                   KM_PHASE_UNCONFIGURED | KM_PHASE_CONFIGURED, KM_COST_CHEAP),
+        KM_COMMAND(KM_GET_HMAC_SHARING_PARAMETERS,
+                   KM_METHOD(GetHmacSharingParameters), KM_PHASE_CONFIGURED,
+                   KM_COST_CHEAP),
+        KM_COMMAND(KM_COMPUTE_SHARED_HMAC, KM_METHOD(ComputeSharedHmac),
+                   KM_PHASE_CONFIGURED, KM_COST_CHEAP),
+        KM_COMMAND(KM_VERIFY_AUTHORIZATION, KM_METHOD(VerifyAuthorization),
+                   KM_PHASE_CONFIGURED, KM_COST_CHEAP),
+        KM_COMMAND(KM_DELETE_KEY, KM_METHOD(DeleteKey), KM_PHASE_CONFIGURED,
+                   KM_COST_CHEAP),
+        KM_COMMAND(KM_DELETE_ALL_KEYS, KM_METHOD(DeleteAllKeys),
+                   KM_PHASE_CONFIGURED, KM_COST_CHEAP),
+        KM_NO_COMMAND, /* KM_DESTROY_ATTESTATION_IDS */
+        KM_COMMAND(KM_IMPORT_WRAPPED_KEY, KM_METHOD(ImportWrappedKey),
+                   KM_PHASE_CONFIGURED, KM_COST_EXPENSIVE),
+};
+
+static const uint32_t kExtensionBase = KM_BATCH >> KEYMASTER_REQ_SHIFT;
+
+/* Indexed by (cmd >> KEYMASTER_REQ_SHIFT) - kExtensionBase. */
+static constexpr keymaster_command_info kExtensionCommands[] = {
+        KM_COMMAND(KM_BATCH, &dispatch_batch, KM_PHASE_CONFIGURED,
+                   KM_COST_EXPENSIVE),
+        KM_COMMAND(KM_ONESHOT_OPERATION, KM_METHOD(OneshotOperation),
+                   KM_PHASE_CONFIGURED, KM_COST_EXPENSIVE),
+        KM_NO_COMMAND, /* KM_REQUEST_FRAGMENT, handled in handle_msg */
+        KM_NO_COMMAND, /* KM_TAGGED, handled in handle_msg */
+        KM_COMMAND(KM_GET_STATS, &dispatch_get_stats, KM_PHASE_ANY,
+                   KM_COST_CHEAP),
+};
+
+/*
+ * Bootloader commands are numbered 0xN000 + k, with k below
+ * kBootloaderRowSize. Indexed by
+ * ((cmd >> KEYMASTER_REQ_SHIFT >> 12) - 1) * kBootloaderRowSize + k.
+ */
+static const size_t kBootloaderRowSize = 2;
+
+static constexpr keymaster_command_info kBootloaderCommands[] = {
+        KM_COMMAND(KM_SET_BOOT_PARAMS, KM_METHOD(SetBootParams),
+                   KM_PHASE_BOOTLOADER, KM_COST_CHEAP),
+        KM_COMMAND(KM_PROVISION_KEYBOX, KM_METHOD(ProvisionAttesationKeybox),
+                   KM_PHASE_CONFIGURED, KM_COST_EXPENSIVE),
+        KM_COMMAND(KM_SET_ATTESTATION_KEY, KM_METHOD(SetAttestationKey),
+                   KM_PHASE_BOOTLOADER, KM_COST_EXPENSIVE),
+        KM_NO_COMMAND,
+        KM_COMMAND(KM_APPEND_ATTESTATION_CERT_CHAIN,
+                   KM_METHOD(AppendAttestationCertChain), KM_PHASE_BOOTLOADER,
+                   KM_COST_EXPENSIVE),
+        KM_NO_COMMAND,
+        KM_COMMAND(KM_ATAP_GET_CA_REQUEST, KM_METHOD(AtapGetCaRequest),
+                   KM_PHASE_BOOTLOADER, KM_COST_EXPENSIVE),
+        KM_NO_COMMAND,
+        KM_COMMAND(KM_ATAP_SET_CA_RESPONSE_BEGIN,
+                   KM_METHOD(AtapSetCaResponseBegin), KM_PHASE_BOOTLOADER,
+                   KM_COST_CHEAP),
+        KM_NO_COMMAND,
+        KM_COMMAND(KM_ATAP_SET_CA_RESPONSE_UPDATE,
+                   KM_METHOD(AtapSetCaResponseUpdate), KM_PHASE_BOOTLOADER,
+                   KM_COST_CHEAP),
+        KM_NO_COMMAND,
+        KM_COMMAND(KM_ATAP_SET_CA_RESPONSE_FINISH,
+                   KM_METHOD(AtapSetCaResponseFinish), KM_PHASE_BOOTLOADER,
+                   KM_COST_EXPENSIVE),
+        KM_NO_COMMAND,
+        KM_COMMAND(KM_ATAP_READ_UUID, KM_METHOD(AtapReadUuid),
+                   KM_PHASE_BOOTLOADER, KM_COST_CHEAP),
+        KM_NO_COMMAND,
+        KM_COMMAND(KM_SET_PRODUCT_ID, KM_METHOD(AtapSetProductId),
+                   KM_PHASE_BOOTLOADER, KM_COST_EXPENSIVE),
+        KM_NO_COMMAND,
+};
+
+#undef KM_METHOD
+#undef KM_COMMAND
+#undef KM_NO_COMMAND
+
+#define TABLE_SIZE(table) (sizeof(table) / sizeof(table[0]))
+
+/*
+ * Checks at compile time that every entry sits at the index of its command.
+ * Rows of |row_size| entries hold commands first_id + k, and each following
+ * row starts 0x1000 ids further on.
+ */
+static constexpr bool commands_in_place(const keymaster_command_info* table,
+                                        size_t count,
+                                        uint32_t first_id,
+                                        size_t row_size) {
+    for (size_t i = 0; i < count; i++) {
+        uint32_t id = first_id + (i / row_size) * 0x1000 + i % row_size;
+        if (table[i].handler && table[i].cmd != id << KEYMASTER_REQ_SHIFT) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static_assert(commands_in_place(kStandardCommands,
+                                TABLE_SIZE(kStandardCommands), 0,
+                                TABLE_SIZE(kStandardCommands)),
+              "kStandardCommands out of order");
+static_assert(commands_in_place(kExtensionCommands,
+                                TABLE_SIZE(kExtensionCommands), kExtensionBase,
+                                TABLE_SIZE(kExtensionCommands)),
+              "kExtensionCommands out of order");
+static_assert(commands_in_place(kBootloaderCommands,
+                                TABLE_SIZE(kBootloaderCommands), 0x1000,
+                                kBootloaderRowSize),
+              "kBootloaderCommands out of order");
+
+/*
+ * The commands the bootloader may send before KM_CONFIGURE. KM_PROVISION_KEYBOX
+ * sits in the bootloader range but has always required a configured TA.
+ */
+static constexpr bool cmd_is_from_bootloader(uint32_t cmd) {
+    return cmd == KM_SET_BOOT_PARAMS || cmd == KM_SET_ATTESTATION_KEY ||
+           cmd == KM_APPEND_ATTESTATION_CERT_CHAIN ||
+           cmd == KM_ATAP_GET_CA_REQUEST ||
+           cmd == KM_ATAP_SET_CA_RESPONSE_BEGIN ||
+           cmd == KM_ATAP_SET_CA_RESPONSE_UPDATE ||
+           cmd == KM_ATAP_SET_CA_RESPONSE_FINISH || cmd == KM_ATAP_READ_UUID ||
+           cmd == KM_SET_PRODUCT_ID;
+}
+
+/*
+ * Phases in which the dispatcher accepted |cmd| before the command tables
+ * existed: KM_GET_VERSION always, KM_CONFIGURE until a configure fails,
+ * bootloader commands only before configure, and the rest only after a
+ * successful configure.
+ */
+static constexpr uint8_t legacy_phases(uint32_t cmd) {
+    return cmd == KM_GET_VERSION ? KM_PHASE_ANY
+           : cmd == KM_CONFIGURE
+                   ? static_cast<uint8_t>(KM_PHASE_UNCONFIGURED |
+                                          KM_PHASE_CONFIGURED)
+           : cmd_is_from_bootloader(cmd)
+                   ? KM_PHASE_BOOTLOADER
+                   : static_cast<uint8_t>(KM_PHASE_CONFIGURED);
+}
+
+/* Checks that |table| accepts each command in the same phases as before. */
+static constexpr bool phases_unchanged(const keymaster_command_info* table,
+                                       size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        if (table[i].handler &&
+            table[i].phases != legacy_phases(table[i].cmd)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static_assert(phases_unchanged(kStandardCommands,
+                               TABLE_SIZE(kStandardCommands)),
+              "kStandardCommands phases differ from the legacy dispatcher");
+static_assert(phases_unchanged(kBootloaderCommands,
+                               TABLE_SIZE(kBootloaderCommands)),
+              "kBootloaderCommands phases differ from the legacy dispatcher");
+
+/*
+ * Each table entry has a slot for its counters in command_stats: the
+ * standard commands first, then the extension and bootloader commands.
+ */
+static const size_t kExtensionSlotBase = TABLE_SIZE(kStandardCommands);
+static const size_t kBootloaderSlotBase =
+        kExtensionSlotBase + TABLE_SIZE(kExtensionCommands);
+static const size_t kNumCommandSlots =
+        kBootloaderSlotBase + TABLE_SIZE(kBootloaderCommands);
+
+/*
+ * Returns the slot of the table entry for |cmd|, or kNumCommandSlots if no
+ * table has an entry for it.
+ */
+static size_t command_slot(uint32_t cmd) {
+    if (cmd & (KEYMASTER_RESP_BIT | KEYMASTER_STOP_BIT)) {
+        return kNumCommandSlots;
+    }
+    uint32_t id = cmd >> KEYMASTER_REQ_SHIFT;
+
+    if (id < TABLE_SIZE(kStandardCommands)) {
+        return id;
+    }
+    if (id >= kExtensionBase &&
+        id - kExtensionBase < TABLE_SIZE(kExtensionCommands)) {
+        return kExtensionSlotBase + id - kExtensionBase;
+    }
+    uint32_t group = id >> 12;
+    uint32_t index = id & 0xfff;
+    size_t row_index = (group - 1) * kBootloaderRowSize + index;
+    if (group >= 1 && index < kBootloaderRowSize &&
+        row_index < TABLE_SIZE(kBootloaderCommands)) {
+        return kBootloaderSlotBase + row_index;
+    }
+    return kNumCommandSlots;
+}
+
+static const keymaster_command_info* find_command(uint32_t cmd) {
+    size_t slot = command_slot(cmd);
+    const keymaster_command_info* info;
+    if (slot < kExtensionSlotBase) {
+        info = &kStandardCommands[slot];
+    } else if (slot < kBootloaderSlotBase) {
+        info = &kExtensionCommands[slot - kExtensionSlotBase];
+    } else if (slot < kNumCommandSlots) {
+        info = &kBootloaderCommands[slot - kBootloaderSlotBase];
+    } else {
+        return NULL;
+    }
+    return info->handler ? info : NULL;
+}
+
+static CommandStats command_stats[kNumCommandSlots];
+static uint64_t stats_reset_time_us;
+
+static uint64_t now_us(void) {
+    int64_t time_ns = 0;
+    if (gettime(0, 0, &time_ns) != NO_ERROR || time_ns < 0) {
+        return 0;
+    }
+    return time_ns / 1000;
+}
+
+/*
+ * Appends a keymaster_command_stats entry to |out| for each command in |table|
+ * that has been called, and adds their number to |num_commands|. The table's
+ * counters start at |slot_base| in command_stats.
+ */
+static long export_stats(const keymaster_command_info* table,
+                         size_t count,
+                         size_t slot_base,
+                         MessageArena* out,
+                         uint32_t* num_commands) {
+    for (size_t i = 0; i < count; i++) {
+        const CommandStats& stats = command_stats[slot_base + i];
+        if (!table[i].handler || !stats.calls()) {
+            continue;
+        }
+        keymaster_command_stats entry;
+        stats.Export(table[i].cmd, &entry);
+        uint8_t* buf = out->Append(sizeof(entry));
+        if (buf == NULL) {
+            return ERR_NO_MEMORY;
+        }
+        memcpy(buf, &entry, sizeof(entry));
+        (*num_commands)++;
+    }
+    return NO_ERROR;
+}
+
+/*
+ * Answers KM_GET_STATS with the layout described with keymaster_stats_header.
+ */
+static long dispatch_get_stats(keymaster_chan_ctx* ctx,
+                               keymaster_message* msg,
+                               uint32_t payload_size,
+                               MessageArena* out) {
+    uint32_t flags = 0;
+    if (payload_size >= sizeof(flags)) {
+        memcpy(&flags, msg->payload, sizeof(flags));
+    }
+
+    // The arena may move as entries are appended, so track the offset.
+    size_t header_offset = out->size();
+    if (out->Append(sizeof(keymaster_stats_header)) == NULL) {
+        return ERR_NO_MEMORY;
+    }
+
+    uint64_t now = now_us();
+    keymaster_stats_header header = {now - stats_reset_time_us, 0, 0};
+    long rc = export_stats(kStandardCommands, TABLE_SIZE(kStandardCommands),
+                           0, out, &header.num_commands);
+    if (rc == NO_ERROR) {
+        rc = export_stats(kExtensionCommands, TABLE_SIZE(kExtensionCommands),
+                          kExtensionSlotBase, out, &header.num_commands);
+    }
+    if (rc == NO_ERROR) {
+        rc = export_stats(kBootloaderCommands, TABLE_SIZE(kBootloaderCommands),
+                          kBootloaderSlotBase, out, &header.num_commands);
+    }
+    if (rc != NO_ERROR) {
+        return rc;
+    }
+    memcpy(out->data() + header_offset, &header, sizeof(header));
+
+    if (flags & KEYMASTER_STATS_RESET) {
+        for (CommandStats& stats : command_stats) {
+            stats.Reset();
+        }
+        stats_reset_time_us = now;
+    }
+    return NO_ERROR;
+}
+
+static uint8_t current_phase(void) {
+    if (!device->ConfigureCalled()) {
+        return KM_PHASE_UNCONFIGURED;
+    }
+    if (device->get_configure_error() != KM_ERROR_OK) {
+        return KM_PHASE_FAILED;
+    }
+    return KM_PHASE_CONFIGURED;
+}
+
+/*
+ * Returns NO_ERROR if the command described by |info| may run in the current
+ * phase. Unknown commands (|info| is NULL) are treated like any other
+ * configured-only command until keymaster is configured.
+ */
+static long check_phase(const keymaster_command_info* info, uint32_t cmd) {
+    uint8_t phase = current_phase();
+    uint8_t phases =
+            info ? info->phases : static_cast<uint8_t>(KM_PHASE_CONFIGURED);
+    if (phases & phase) {
+        return NO_ERROR;
+    }
+
+    switch (phase) {
+    case KM_PHASE_UNCONFIGURED:
+        LOG_E("Command %d not allowed before configure command\n", cmd);
+        return ERR_NOT_CONFIGURED;
+    case KM_PHASE_FAILED:
+        LOG_E("Previous configure command failed\n", 0);
+        return ERR_NOT_CONFIGURED;
+    default:
+        LOG_E("Bootloader command %d not allowed after configure command\n",
+              cmd);
+        return ERR_NOT_IMPLEMENTED;
+    }
 }
 
 static long keymaster_dispatch_non_secure(keymaster_chan_ctx* ctx,
                                           keymaster_message* msg,
                                           uint32_t payload_size,
-                                          keymaster::UniquePtr<uint8_t[]>* out,
-                                          uint32_t* out_size) {
-    if (msg->cmd == KM_GET_VERSION) {
-        // KM_GET_VERSION command is always allowed
-    } else if (!device->ConfigureCalled()) {
-        if (!cmd_allowed_before_configure(msg->cmd)) {
-            LOG_E("Command %d not allowed before configure command\n",
-                  msg->cmd);
-            return ERR_NOT_CONFIGURED;
-        }
-    } else if (device->ConfigureCalled()) {
-        if (device->get_configure_error() != KM_ERROR_OK) {
-            LOG_E("Previous configure command failed\n", 0);
-            return ERR_NOT_CONFIGURED;
-        } else if (cmd_is_from_bootloader(msg->cmd)) {
-            LOG_E("Bootloader command %d not allowed after configure command\n",
-                  msg->cmd);
-            return ERR_NOT_IMPLEMENTED;
+                                          MessageArena* out) {
+    const keymaster_command_info* info = find_command(msg->cmd);
+    long rc = check_phase(info, msg->cmd);
+    if (rc == NO_ERROR && info == NULL) {
+        LOG_E("Cannot dispatch unknown command %d", msg->cmd);
+        rc = ERR_NOT_IMPLEMENTED;
+    }
+    if (rc != NO_ERROR) {
+        if (info) {
+            command_stats[command_slot(msg->cmd)].Record(
+                    payload_size, sizeof(keymaster_error_t), 0, true);
         }
+        return rc;
     }
 
-    switch (msg->cmd) {
-    case KM_GENERATE_KEY:
-        LOG_D("Dispatching GENERATE_KEY, size: %d", payload_size);
-        return do_dispatch(&TrustyKeymaster::GenerateKey, msg, payload_size,
-                           out, out_size);
-
-    case KM_BEGIN_OPERATION:
-        LOG_D("Dispatching BEGIN_OPERATION, size: %d", payload_size);
-        return do_dispatch(&TrustyKeymaster::BeginOperation, msg, payload_size,
-                           out, out_size);
-
-    case KM_UPDATE_OPERATION:
-        LOG_D("Dispatching UPDATE_OPERATION, size: %d", payload_size);
-        return do_dispatch(&TrustyKeymaster::UpdateOperation, msg, payload_size,
-                           out, out_size);
-
-    case KM_FINISH_OPERATION:
-        LOG_D("Dispatching FINISH_OPERATION, size: %d", payload_size);
-        return do_dispatch(&TrustyKeymaster::FinishOperation, msg, payload_size,
-                           out, out_size);
-
-    case KM_IMPORT_KEY:
-        LOG_D("Dispatching IMPORT_KEY, size: %d", payload_size);
-        return do_dispatch(&TrustyKeymaster::ImportKey, msg, payload_size, out,
-                           out_size);
-
-    case KM_EXPORT_KEY:
-        LOG_D("Dispatching EXPORT_KEY, size: %d", payload_size);
-        return do_dispatch(&TrustyKeymaster::ExportKey, msg, payload_size, out,
-                           out_size);
-
-    case KM_GET_VERSION:
-        LOG_D("Dispatching GET_VERSION, size: %d", payload_size);
-        return do_dispatch(&TrustyKeymaster::GetVersion, msg, payload_size, out,
-                           out_size);
-
-    case KM_ADD_RNG_ENTROPY:
-        LOG_D("Dispatching ADD_RNG_ENTROPY, size: %d", payload_size);
-        return do_dispatch(&TrustyKeymaster::AddRngEntropy, msg, payload_size,
-                           out, out_size);
-
-    case KM_GET_SUPPORTED_ALGORITHMS:
-        LOG_D("Dispatching GET_SUPPORTED_ALGORITHMS, size: %d", payload_size);
-        return do_dispatch(&TrustyKeymaster::SupportedAlgorithms, msg,
-                           payload_size, out, out_size);
-
-    case KM_GET_SUPPORTED_BLOCK_MODES:
-        LOG_D("Dispatching GET_SUPPORTED_BLOCK_MODES, size: %d", payload_size);
-        return do_dispatch(&TrustyKeymaster::SupportedBlockModes, msg,
-                           payload_size, out, out_size);
-
-    case KM_GET_SUPPORTED_PADDING_MODES:
-        LOG_D("Dispatching GET_SUPPORTED_PADDING_MODES, size: %d",
-              payload_size);
-        return do_dispatch(&TrustyKeymaster::SupportedPaddingModes, msg,
-                           payload_size, out, out_size);
-
-    case KM_GET_SUPPORTED_DIGESTS:
-        LOG_D("Dispatching GET_SUPPORTED_DIGESTS, size: %d", payload_size);
-        return do_dispatch(&TrustyKeymaster::SupportedDigests, msg,
-                           payload_size, out, out_size);
-
-    case KM_GET_SUPPORTED_IMPORT_FORMATS:
-        LOG_D("Dispatching GET_SUPPORTED_IMPORT_FORMATS, size: %d",
-              payload_size);
-        return do_dispatch(&TrustyKeymaster::SupportedImportFormats, msg,
-                           payload_size, out, out_size);
-
-    case KM_GET_SUPPORTED_EXPORT_FORMATS:
-        LOG_D("Dispatching GET_SUPPORTED_EXPORT_FORMATS, size: %d",
-              payload_size);
-        return do_dispatch(&TrustyKeymaster::SupportedExportFormats, msg,
-                           payload_size, out, out_size);
-
-    case KM_GET_KEY_CHARACTERISTICS:
-        LOG_D("Dispatching GET_KEY_CHARACTERISTICS, size: %d", payload_size);
-        return do_dispatch(&TrustyKeymaster::GetKeyCharacteristics, msg,
-                           payload_size, out, out_size);
-
-    case KM_ABORT_OPERATION:
-        LOG_D("Dispatching ABORT_OPERATION, size %d", payload_size);
-        return do_dispatch(&TrustyKeymaster::AbortOperation, msg, payload_size,
-                           out, out_size);
-
-    case KM_ATTEST_KEY:
-        LOG_D("Dispatching ATTEST_KEY, size %d", payload_size);
-        return do_dispatch(&TrustyKeymaster::AttestKey, msg, payload_size, out,
-                           out_size);
-
-    case KM_UPGRADE_KEY:
-        LOG_D("Dispatching UPGRADE_KEY, size %d", payload_size);
-        return do_dispatch(&TrustyKeymaster::UpgradeKey, msg, payload_size, out,
-                           out_size);
-
-    case KM_CONFIGURE:
-        LOG_D("Dispatching CONFIGURE, size %d", payload_size);
-        return do_dispatch(&TrustyKeymaster::Configure, msg, payload_size, out,
-                           out_size);
-
-    case KM_GET_HMAC_SHARING_PARAMETERS:
-        LOG_D("Dispatching GET_HMAC_SHARING_PARAMETERS, size %d", payload_size);
-        return do_dispatch(&TrustyKeymaster::GetHmacSharingParameters, msg,
-                           payload_size, out, out_size);
-
-    case KM_COMPUTE_SHARED_HMAC:
-        LOG_D("Dispatching COMPUTE_SHARED_HMAC, size %d", payload_size);
-        return do_dispatch(&TrustyKeymaster::ComputeSharedHmac, msg,
-                           payload_size, out, out_size);
-
-    case KM_VERIFY_AUTHORIZATION:
-        LOG_D("Dispatching VERIFY_AUTHORIZATION, size %d", payload_size);
-        return do_dispatch(&TrustyKeymaster::VerifyAuthorization, msg,
-                           payload_size, out, out_size);
-
-    case KM_IMPORT_WRAPPED_KEY:
-        LOG_D("Dispatching IMPORT_WRAPPED_KEY, size %d", payload_size);
-        return do_dispatch(&TrustyKeymaster::ImportWrappedKey, msg,
-                           payload_size, out, out_size);
-
-    case KM_DELETE_KEY:
-        LOG_D("Dispatching DELETE_KEY, size %d", payload_size);
-        return do_dispatch(&TrustyKeymaster::DeleteKey, msg, payload_size, out,
-                           out_size);
-
-    case KM_DELETE_ALL_KEYS:
-        LOG_D("Dispatching DELETE_ALL_KEYS, size %d", payload_size);
-        return do_dispatch(&TrustyKeymaster::DeleteAllKeys, msg, payload_size,
-                           out, out_size);
-
-    case KM_SET_BOOT_PARAMS:
-        LOG_D("Dispatching SET_BOOT_PARAMS, size %d", payload_size);
-        return do_dispatch(&TrustyKeymaster::SetBootParams, msg, payload_size,
-                           out, out_size);
-
-    case KM_PROVISION_KEYBOX:
-        LOG_D("Dispatching KM_PROVISION_KEYBOX, size %d", payload_size);
-        return do_dispatch(&TrustyKeymaster::ProvisionAttesationKeybox, msg, payload_size,
-                           out, out_size);
-
-    case KM_SET_ATTESTATION_KEY:
-        LOG_D("Dispatching SET_ATTESTION_KEY, size %d", payload_size);
-        return do_dispatch(&TrustyKeymaster::SetAttestationKey, msg,
-                           payload_size, out, out_size);
-
-    case KM_APPEND_ATTESTATION_CERT_CHAIN:
-        LOG_D("Dispatching SET_ATTESTATION_CERT_CHAIN, size %d", payload_size);
-        return do_dispatch(&TrustyKeymaster::AppendAttestationCertChain, msg,
-                           payload_size, out, out_size);
-
-    case KM_ATAP_GET_CA_REQUEST:
-        LOG_D("Dispatching KM_ATAP_GET_CA_REQUEST, size %d", payload_size);
-        return do_dispatch(&TrustyKeymaster::AtapGetCaRequest, msg,
-                           payload_size, out, out_size);
-
-    case KM_ATAP_SET_CA_RESPONSE_BEGIN:
-        LOG_D("Dispatching KM_ATAP_SET_CA_RESPONSE_BEGIN, size %d",
-              payload_size);
-        return do_dispatch(&TrustyKeymaster::AtapSetCaResponseBegin, msg,
-                           payload_size, out, out_size);
-
-    case KM_ATAP_SET_CA_RESPONSE_UPDATE:
-        LOG_D("Dispatching KM_ATAP_SET_CA_RESPONSE_UPDATE, size %d",
-              payload_size);
-        return do_dispatch(&TrustyKeymaster::AtapSetCaResponseUpdate, msg,
-                           payload_size, out, out_size);
-
-    case KM_ATAP_SET_CA_RESPONSE_FINISH:
-        LOG_D("Dispatching KM_ATAP_SET_CA_RESPONSE_FINISH, size %d",
-              payload_size);
-        return do_dispatch(&TrustyKeymaster::AtapSetCaResponseFinish, msg,
-                           payload_size, out, out_size);
-
-    case KM_ATAP_READ_UUID:
-        LOG_D("Dispatching KM_ATAP_READ_UUID, size %d", payload_size);
-        return do_dispatch(&TrustyKeymaster::AtapReadUuid, msg, payload_size,
-                           out, out_size);
-
-    case KM_SET_PRODUCT_ID:
-        LOG_D("Dispatching KM_SET_PRODUCT_ID, size %d", payload_size);
-        return do_dispatch(&TrustyKeymaster::AtapSetProductId, msg,
-                           payload_size, out, out_size);
+    LOG_D("Dispatching %s, size %d", info->name, payload_size);
+    uint64_t start = now_us();
+    size_t out_start = out->size();
+    dispatch_error = KM_ERROR_OK;
 
-    default:
-        LOG_E("Cannot dispatch unknown command %d", msg->cmd);
-        return ERR_NOT_IMPLEMENTED;
+    rc = info->handler(ctx, msg, payload_size, out);
+
+    uint64_t end = now_us();
+    size_t response_bytes;
+    if (response_stream != NULL && response_stream->sent()) {
+        response_bytes = response_stream->bytes_written();
+    } else if (rc < 0) {
+        response_bytes = sizeof(keymaster_error_t);
+    } else {
+        response_bytes = out->size() - out_start;
+    }
+    command_stats[command_slot(msg->cmd)].Record(
+            payload_size, response_bytes, end >= start ? end - start : 0,
+            rc < 0 || dispatch_error != KM_ERROR_OK);
+    dispatch_error = KM_ERROR_OK;
+    return rc;
+}
+
+/*
+ * Channels with requests waiting. They are served in turns of up to
+ * KEYMASTER_MSGS_PER_TURN messages, round-robin within a queue, so a chatty
+ * client cannot starve the others. Turns alternate between the secure port
+ * and the non-secure one, so gatekeeper gets at least every other turn when it
+ * has work. Non-secure channels whose next request is cheap go before those
+ * about to start an expensive one, which keeps queries and authorization
+ * checks from waiting behind a queue of key generations. That preference is
+ * bounded: after KEYMASTER_MAX_CHEAP_TURNS cheap turns in a row with an
+ * expensive channel waiting, the expensive channel gets the next turn, so a
+ * steady stream of cheap requests cannot starve it.
+ */
+#ifndef KEYMASTER_MSGS_PER_TURN
+#define KEYMASTER_MSGS_PER_TURN KEYMASTER_MAX_IN_FLIGHT
+#endif
+
+#ifndef KEYMASTER_MAX_CHEAP_TURNS
+#define KEYMASTER_MAX_CHEAP_TURNS 4
+#endif
+
+struct keymaster_run_queue {
+    keymaster_chan_ctx* head;
+    keymaster_chan_ctx* tail;
+};
+
+static keymaster_run_queue run_queue_secure;
+static keymaster_run_queue run_queue_cheap;
+static keymaster_run_queue run_queue_expensive;
+static bool last_turn_secure;
+static int cheap_turns_in_a_row;
+
+static keymaster_run_queue* run_queue_for(keymaster_chan_ctx* ctx) {
+    if (ctx->secure) {
+        return &run_queue_secure;
+    }
+    return ctx->next_cost == KM_COST_EXPENSIVE ? &run_queue_expensive
+                                                : &run_queue_cheap;
+}
+
+static void schedule_chan(keymaster_chan_ctx* ctx) {
+    if (ctx->scheduled) {
+        return;
+    }
+    keymaster_run_queue* queue = run_queue_for(ctx);
+    ctx->scheduled = true;
+    ctx->next_scheduled = NULL;
+    if (queue->tail) {
+        queue->tail->next_scheduled = ctx;
+    } else {
+        queue->head = ctx;
+    }
+    queue->tail = ctx;
+}
+
+static void unschedule_chan(keymaster_chan_ctx* ctx) {
+    if (!ctx->scheduled) {
+        return;
+    }
+    keymaster_run_queue* queue = run_queue_for(ctx);
+    keymaster_chan_ctx* prev = NULL;
+    for (keymaster_chan_ctx* it = queue->head; it != ctx;
+         it = it->next_scheduled) {
+        prev = it;
+    }
+    if (prev) {
+        prev->next_scheduled = ctx->next_scheduled;
+    } else {
+        queue->head = ctx->next_scheduled;
+    }
+    if (queue->tail == ctx) {
+        queue->tail = prev;
+    }
+    ctx->scheduled = false;
+    ctx->next_scheduled = NULL;
+}
+
+/*
+ * Takes the channel whose turn is next off its run queue, or returns NULL if
+ * no channel has requests waiting.
+ */
+static keymaster_chan_ctx* next_scheduled_chan(void) {
+    keymaster_chan_ctx* non_secure = run_queue_cheap.head;
+    if (run_queue_expensive.head &&
+        (!non_secure || cheap_turns_in_a_row >= KEYMASTER_MAX_CHEAP_TURNS)) {
+        non_secure = run_queue_expensive.head;
+    }
+    keymaster_chan_ctx* ctx;
+    if (run_queue_secure.head && (!last_turn_secure || !non_secure)) {
+        ctx = run_queue_secure.head;
+    } else {
+        ctx = non_secure;
+    }
+    if (ctx == NULL) {
+        return NULL;
+    }
+    if (!ctx->secure) {
+        bool passed_over = ctx->next_cost != KM_COST_EXPENSIVE &&
+                           run_queue_expensive.head;
+        cheap_turns_in_a_row = passed_over ? cheap_turns_in_a_row + 1 : 0;
     }
+    last_turn_secure = ctx->secure;
+    unschedule_chan(ctx);
+    return ctx;
 }
 
 static bool keymaster_port_accessible(uuid_t* uuid, bool secure) {
@@ -578,45 +1282,209 @@ static keymaster_chan_ctx* keymaster_ctx_open(handle_t chan,
     if (ctx == NULL) {
         return ctx;
     }
+    ctx->recv_buf.reset(new uint8_t[ctx->max_msg_size + 1]);
+    if (ctx->recv_buf.get() == NULL) {
+        delete ctx;
+        return NULL;
+    }
 
     ctx->handler.proc = &keymaster_chan_handler;
     ctx->handler.priv = ctx;
     ctx->uuid = *uuid;
     ctx->chan = chan;
+    ctx->secure = secure;
     ctx->dispatch = secure ? &keymaster_dispatch_secure
                            : &keymaster_dispatch_non_secure;
     return ctx;
 }
 
 static void keymaster_ctx_close(keymaster_chan_ctx* ctx) {
+    unschedule_chan(ctx);
     close(ctx->chan);
     delete ctx;
 }
 
-static long handle_msg(keymaster_chan_ctx* ctx) {
+/*
+ * Adds the payload of |msg| to the request being reassembled on |ctx|. Once
+ * the final (non-fragment) message is in, the request is left in ctx->request
+ * with its header filled in. A request that does not fit is discarded, and
+ * the failure is kept in ctx->request_error for the final message to report.
+ */
+static void reassemble_request(keymaster_chan_ctx* ctx,
+                               keymaster_message* msg,
+                               uint32_t payload_size) {
+    MessageArena* request = &ctx->request;
+    bool last = msg->cmd != KM_REQUEST_FRAGMENT;
+
+    if (ctx->request_error == NO_ERROR) {
+        size_t size = request->size() ? request->size()
+                                      : sizeof(keymaster_message);
+        uint8_t* dst;
+        if (size + payload_size > KEYMASTER_MAX_REQUEST_LENGTH) {
+            LOG_E("reassembled request exceeds %d bytes",
+                  KEYMASTER_MAX_REQUEST_LENGTH);
+            ctx->request_error = ERR_TOO_BIG;
+        } else if ((request->size() == 0 &&
+                    request->Append(sizeof(keymaster_message)) == NULL) ||
+                   (dst = request->Append(payload_size + last)) == NULL) {
+            ctx->request_error = ERR_NO_MEMORY;
+        } else {
+            memcpy(dst, msg->payload, payload_size);
+        }
+        if (ctx->request_error != NO_ERROR) {
+            request->Shrink(KEYMASTER_MESSAGE_ARENA_RETAIN_BYTES);
+            return;
+        }
+    }
+
+    if (last && ctx->request_error == NO_ERROR) {
+        // Null-terminate like a message read into recv_buf.
+        request->data()[request->size() - 1] = 0;
+        reinterpret_cast<keymaster_message*>(request->data())->cmd = msg->cmd;
+    }
+}
+
+/*
+ * KM_UPDATE_OPERATION requests with more input than this are expensive. One
+ * legacy-sized message of cipher or MAC input is handled in well under a
+ * millisecond, but a request reassembled or sent at a negotiated larger size
+ * can be several times that.
+ */
+#ifndef KEYMASTER_CHEAP_UPDATE_BYTES
+#define KEYMASTER_CHEAP_UPDATE_BYTES KEYMASTER_MAX_BUFFER_LENGTH
+#endif
+
+/*
+ * Returns the keymaster_cost of the message of |len| bytes in ctx->recv_buf.
+ * Fragments are only copied, so they are cheap; the final message of a
+ * fragmented request is classified by its command. Operation requests are
+ * classified by what they carry rather than by the table: an update by its
+ * size, and a finish by whether the operation uses an RSA or EC key.
+ */
+static uint8_t message_cost(keymaster_chan_ctx* ctx, uint32_t len) {
+    keymaster_message* msg =
+            reinterpret_cast<keymaster_message*>(ctx->recv_buf.get());
+    uint32_t cmd = msg->cmd;
+
+    /*
+     * The request may be partly reassembled already, and then starts there.
+     * |size| is the whole payload and |avail| what can be read at |payload|.
+     */
+    const uint8_t* payload = msg->payload;
+    size_t avail = len - sizeof(*msg);
+    size_t size = avail;
+    if (ctx->request.size()) {
+        payload = ctx->request.data() + sizeof(keymaster_message);
+        avail = ctx->request.size() - sizeof(keymaster_message);
+        size += avail;
+    }
+
+    if (cmd == KM_TAGGED) {
+        // The tag leads the request.
+        keymaster_request_tag tag;
+        if (avail < sizeof(tag)) {
+            return KM_COST_CHEAP;
+        }
+        memcpy(&tag, payload, sizeof(tag));
+        cmd = tag.cmd;
+        payload += sizeof(tag);
+        avail -= sizeof(tag);
+        size -= sizeof(tag);
+    }
+
+    if (cmd == KM_UPDATE_OPERATION) {
+        return size > KEYMASTER_CHEAP_UPDATE_BYTES
+                       ? KM_COST_EXPENSIVE
+                       : static_cast<uint8_t>(KM_COST_CHEAP);
+    }
+    if (cmd == KM_FINISH_OPERATION) {
+        // The operation handle leads the serialized request.
+        keymaster_operation_handle_t op_handle;
+        if (avail < sizeof(op_handle)) {
+            return KM_COST_CHEAP;
+        }
+        memcpy(&op_handle, payload, sizeof(op_handle));
+        return device->IsAsymmetricOperation(op_handle)
+                       ? KM_COST_EXPENSIVE
+                       : static_cast<uint8_t>(KM_COST_CHEAP);
+    }
+
+    const keymaster_command_info* info = find_command(cmd);
+    return info ? info->cost : static_cast<uint8_t>(KM_COST_CHEAP);
+}
+
+/*
+ * True if |ctx| still has response messages queued. Its requests are left
+ * alone until they have been sent.
+ */
+static bool send_blocked(const keymaster_chan_ctx* ctx) {
+    return ctx->outbound.size() != 0;
+}
+
+/*
+ * Takes the messages pending on a channel that cannot be served yet, because
+ * its turn is already scheduled or its responses are backed up, into
+ * ctx->held_msgs without reading them, so that their IPC_HANDLE_POLL_MSG
+ * event does not keep waking the TA.
+ */
+static long hold_pending_msgs(keymaster_chan_ctx* ctx) {
+    while (ctx->num_held_msgs < KEYMASTER_MAX_IN_FLIGHT) {
+        int rc = get_msg(ctx->chan, &ctx->held_msgs[ctx->num_held_msgs]);
+        if (rc == ERR_NO_MSG) {
+            break;
+        }
+        if (rc != NO_ERROR) {
+            LOG_E("failed (%d) to get_msg for chan (%d)", rc, ctx->chan);
+            return rc;
+        }
+        ctx->num_held_msgs++;
+    }
+    return NO_ERROR;
+}
+
+/*
+ * Reads the next message on |ctx| into ctx->recv_buf, unless one is waiting
+ * there already, and notes its cost. Returns ERR_NO_MSG if there is none.
+ */
+static long read_next_msg(keymaster_chan_ctx* ctx) {
+    if (ctx->has_next_msg) {
+        return NO_ERROR;
+    }
     handle_t chan = ctx->chan;
 
     /* get message info */
     ipc_msg_info_t msg_inf;
-    int rc = get_msg(chan, &msg_inf);
-    if (rc == ERR_NO_MSG)
-        return NO_ERROR; /* no new messages */
+    int rc;
+    if (ctx->num_held_msgs) {
+        msg_inf = ctx->held_msgs[0];
+        ctx->num_held_msgs--;
+        memmove(&ctx->held_msgs[0], &ctx->held_msgs[1],
+                ctx->num_held_msgs * sizeof(ctx->held_msgs[0]));
+    } else {
+        rc = get_msg(chan, &msg_inf);
+        if (rc == ERR_NO_MSG)
+            return ERR_NO_MSG; /* no new messages */
 
-    // fatal error
-    if (rc != NO_ERROR) {
-        LOG_E("failed (%d) to get_msg for chan (%d), closing connection", rc,
-              chan);
-        return rc;
+        // fatal error
+        if (rc != NO_ERROR) {
+            LOG_E("failed (%d) to get_msg for chan (%d), closing connection",
+                  rc, chan);
+            return rc;
+        }
     }
 
-    MessageDeleter md(chan, msg_inf.id);
-
-    // allocate msg_buf, with one extra byte for null-terminator
-    keymaster::UniquePtr<uint8_t[]> msg_buf(new uint8_t[msg_inf.len + 1]);
+    // The port admits messages up to KEYMASTER_MAX_MESSAGE_SIZE, but a client
+    // may only use the size agreed for its channel.
+    if (msg_inf.len > ctx->max_msg_size) {
+        LOG_E("message too large (%d) for chan (%d)", msg_inf.len, chan);
+        put_msg(chan, msg_inf.id);
+        return ERR_TOO_BIG;
+    }
+    uint8_t* msg_buf = ctx->recv_buf.get();
     msg_buf[msg_inf.len] = 0;
 
     /* read msg content */
-    iovec_t iov = {msg_buf.get(), msg_inf.len};
+    iovec_t iov = {msg_buf, msg_inf.len};
     ipc_msg_t msg = {1, &iov, 0, NULL};
 
     rc = read_msg(chan, msg_inf.id, 0, &msg);
@@ -624,33 +1492,130 @@ static long handle_msg(keymaster_chan_ctx* ctx) {
     // fatal error
     if (rc < 0) {
         LOG_E("failed to read msg (%d)", rc, chan);
+        put_msg(chan, msg_inf.id);
         return rc;
     }
     LOG_D("Read %d-byte message", rc);
 
     if (((unsigned long)rc) < sizeof(keymaster_message)) {
         LOG_E("invalid message of size (%d)", rc, chan);
+        put_msg(chan, msg_inf.id);
         return ERR_NOT_VALID;
     }
 
-    keymaster::UniquePtr<uint8_t[]> out_buf;
-    uint32_t out_buf_size = 0;
+    ctx->has_next_msg = true;
+    ctx->next_msg_id = msg_inf.id;
+    ctx->next_msg_len = msg_inf.len;
+    ctx->next_cost = ctx->secure ? static_cast<uint8_t>(KM_COST_CHEAP)
+                                 : message_cost(ctx, msg_inf.len);
+    return NO_ERROR;
+}
+
+static long handle_msg(keymaster_chan_ctx* ctx) {
+    handle_t chan = ctx->chan;
+
+    long rc = read_next_msg(ctx);
+    if (rc != NO_ERROR) {
+        return rc;
+    }
+    ctx->has_next_msg = false;
+    MessageDeleter md(chan, ctx->next_msg_id);
+
     keymaster_message* in_msg =
-            reinterpret_cast<keymaster_message*>(msg_buf.get());
-
-    rc = ctx->dispatch(ctx, in_msg, msg_inf.len - sizeof(*in_msg), &out_buf,
-                       &out_buf_size);
-    if (rc == ERR_NOT_CONFIGURED) {
-        LOG_E("configure error (%d)", rc);
-        return send_error_response(chan, in_msg->cmd,
-                                   device->get_configure_error());
+            reinterpret_cast<keymaster_message*>(ctx->recv_buf.get());
+    uint32_t payload_size = ctx->next_msg_len - sizeof(*in_msg);
+
+    if (in_msg->cmd == KM_REQUEST_FRAGMENT || ctx->request.size() ||
+        ctx->request_error != NO_ERROR) {
+        reassemble_request(ctx, in_msg, payload_size);
+        if (in_msg->cmd == KM_REQUEST_FRAGMENT) {
+            return NO_ERROR; /* more to come */
+        }
+        if (ctx->request_error != NO_ERROR) {
+            keymaster_error_t err = ctx->request_error == ERR_TOO_BIG
+                                            ? KM_ERROR_INVALID_INPUT_LENGTH
+                                            : KM_ERROR_MEMORY_ALLOCATION_FAILED;
+            ctx->request_error = NO_ERROR;
+            return send_error_response(ctx, in_msg->cmd, err);
+        }
+        in_msg = reinterpret_cast<keymaster_message*>(ctx->request.data());
+        payload_size = ctx->request.size() - sizeof(*in_msg) - 1;
+        LOG_D("Reassembled %d-byte request", payload_size);
+    }
+
+    ctx->response.Reset();
+    keymaster_message* km_msg = in_msg;
+    if (in_msg->cmd == KM_TAGGED) {
+        keymaster_request_tag tag;
+        if (payload_size < sizeof(tag)) {
+            LOG_E("invalid tagged message of size (%d)", payload_size);
+            return ERR_NOT_VALID;
+        }
+        memcpy(&tag, in_msg->payload, sizeof(tag));
+        if (tag.cmd == KM_TAGGED || tag.cmd == KM_REQUEST_FRAGMENT) {
+            LOG_E("invalid tagged command %d", tag.cmd);
+            return ERR_NOT_VALID;
+        }
+        tag.cmd |= KEYMASTER_RESP_BIT;
+        uint8_t* prefix = ctx->response.Append(sizeof(tag));
+        if (prefix == NULL) {
+            return ERR_NO_MEMORY;
+        }
+        memcpy(prefix, &tag, sizeof(tag));
+        km_msg = reinterpret_cast<keymaster_message*>(
+                in_msg->payload + offsetof(keymaster_request_tag, cmd));
+        payload_size -= sizeof(tag);
+    }
+    size_t prefix_size = ctx->response.size();
+
+    ChunkedResponseWriter stream(ctx, in_msg->cmd, ctx->max_msg_size,
+                                 &ctx->response);
+    response_stream = km_msg->cmd == KM_BATCH ? NULL : &stream;
+    rc = ctx->dispatch(ctx, km_msg, payload_size, &ctx->response);
+    response_stream = NULL;
+    if (stream.sent()) {
+        // The reply was streamed; a failure now can only close the channel.
+        if (rc < 0) {
+            LOG_E("error streaming response (%d)", rc);
+        }
     } else if (rc < 0) {
-        LOG_E("error handling message (%d)", rc);
-        return send_error_response(chan, in_msg->cmd, KM_ERROR_UNKNOWN_ERROR);
+        keymaster_error_t err;
+        if (rc == ERR_NOT_CONFIGURED) {
+            LOG_E("configure error (%d)", rc);
+            err = device->get_configure_error();
+        } else {
+            LOG_E("error handling message (%d)", rc);
+            err = KM_ERROR_UNKNOWN_ERROR;
+        }
+        // Keep the tag, if any, in front of the error code.
+        ctx->response.Truncate(prefix_size);
+        uint8_t* err_buf = ctx->response.Append(sizeof(err));
+        if (err_buf != NULL) {
+            memcpy(err_buf, &err, sizeof(err));
+            rc = send_response(ctx, in_msg->cmd, ctx->response.data(),
+                               ctx->response.size(), ctx->max_msg_size);
+        } else {
+            rc = send_error_response(ctx, in_msg->cmd, err);
+        }
+    } else {
+        LOG_D("Sending %d-byte response", ctx->response.size());
+        rc = send_response(ctx, in_msg->cmd, ctx->response.data(),
+                           ctx->response.size(), ctx->max_msg_size);
+    }
+
+    if (ctx->next_max_msg_size) {
+        ctx->recv_buf.reset(ctx->next_recv_buf.release());
+        ctx->max_msg_size = ctx->next_max_msg_size;
+        ctx->next_max_msg_size = 0;
+        LOG_D("Message size for chan (%d) is now %d", chan,
+              ctx->max_msg_size);
     }
 
-    LOG_D("Sending %d-byte response", out_buf_size);
-    return send_response(chan, in_msg->cmd, out_buf.get(), out_buf_size);
+    // Wipe the reply now rather than leaving it in the arena until the next
+    // command, and give back storage a one-off large reply grew it to.
+    ctx->response.Shrink(KEYMASTER_MESSAGE_ARENA_RETAIN_BYTES);
+    ctx->request.Shrink(KEYMASTER_MESSAGE_ARENA_RETAIN_BYTES);
+    return rc;
 }
 
 static void keymaster_chan_handler(const uevent_t* ev, void* priv) {
@@ -665,25 +1630,236 @@ static void keymaster_chan_handler(const uevent_t* ev, void* priv) {
         (ev->event & IPC_HANDLE_POLL_READY)) {
         /* close it as it is in an error state */
         LOG_E("error event (0x%x) for chan (%d)", ev->event, ev->handle);
-        close(ev->handle);
+        keymaster_ctx_close(ctx);
         return;
     }
 
-    if (ev->event & IPC_HANDLE_POLL_MSG) {
-        long rc = handle_msg(ctx);
+    if (ev->event & IPC_HANDLE_POLL_SEND_UNBLOCKED) {
+        long rc = flush_outbound(ctx);
         if (rc != NO_ERROR) {
-            /* report an error and close channel */
-            LOG_E("failed (%d) to handle event on channel %d", rc, ev->handle);
+            LOG_E("failed (%d) to resume sending on channel %d", rc,
+                  ev->handle);
             keymaster_ctx_close(ctx);
             return;
         }
     }
 
     if (ev->event & IPC_HANDLE_POLL_HUP) {
-        /* closed by peer. */
+        /* closed by peer; its requests could not be answered any more. */
         keymaster_ctx_close(ctx);
         return;
     }
+
+    long rc = NO_ERROR;
+    if (send_blocked(ctx) || ctx->scheduled) {
+        /* picked up again once the backlog has been sent, or on its turn */
+        if (ev->event & IPC_HANDLE_POLL_MSG) {
+            rc = hold_pending_msgs(ctx);
+        }
+    } else if ((ev->event & IPC_HANDLE_POLL_MSG) || ctx->num_held_msgs ||
+               ctx->has_next_msg) {
+        /* served by run_scheduled_turn() */
+        rc = read_next_msg(ctx);
+        if (rc == NO_ERROR) {
+            schedule_chan(ctx);
+        } else if (rc == ERR_NO_MSG) {
+            rc = NO_ERROR;
+        }
+    }
+    if (rc != NO_ERROR) {
+        LOG_E("failed (%d) to handle event on channel %d", rc, ev->handle);
+        keymaster_ctx_close(ctx);
+    }
+}
+
+/*
+ * Housekeeping done between requests. A turn that finds no channel scheduled
+ * gives one slice to the next due task, round-robin, and events are collected
+ * again before the next slice. A request that arrives in the meantime
+ * therefore waits for at most one slice, so each slice must do a single
+ * bounded piece of work (one key, one reseed) and return.
+ *
+ * A task is due whenever |pending| reports work and, if it has a period,
+ * also |period_ms| after its last slice. collect_events() sleeps in wait_any
+ * only until the earliest periodic task is due.
+ */
+
+/* wait_any timeout that never expires */
+#define KM_WAIT_FOREVER UINT32_MAX
+
+struct keymaster_idle_task {
+    const char* name;
+    uint32_t period_ms;
+    bool (*pending)(void);
+    void (*run_slice)(void);
+};
+
+/*
+ * Nothing is generated until keymaster is configured, so the bootloader is
+ * never kept waiting behind the key pool.
+ */
+static bool key_pool_pending(void) {
+    return current_phase() == KM_PHASE_CONFIGURED &&
+           device->key_pool()->NeedsRefill();
+}
+
+/*
+ * Hands one pending event, if any, to its handler. Returns false if there was
+ * none.
+ */
+static bool dispatch_pending_event(void) {
+    uevent_t event;
+    event.handle = INVALID_IPC_HANDLE;
+    event.event = 0;
+    event.cookie = NULL;
+    if (wait_any(&event, 0) != NO_ERROR) {
+        return false;
+    }
+    dispatch_event(&event);
+    return true;
+}
+
+/*
+ * An RSA key takes long enough that a request arriving just before it starts
+ * would wait noticeably, so it is only started once no event is pending. An
+ * event found here is handled and the key left for a later slice.
+ */
+static void refill_key_pool(void) {
+    KeyPool* pool = device->key_pool();
+    if (pool->NextRefillIsSlow() && dispatch_pending_event()) {
+        return;
+    }
+    pool->RefillOne();
+}
+
+static bool entropy_pool_pending(void) {
+    return device->entropy_pool()->NeedsRefill();
+}
+
+static void refill_entropy_pool(void) {
+    device->entropy_pool()->RefillOne();
+}
+
+/*
+ * After a failed reseed only the period brings the task round again, so a
+ * broken hardware RNG is not retried on every idle turn.
+ */
+static bool rng_reseed_pending(void) {
+    return device->RngReseedDue() && !device->RngReseedFailed();
+}
+
+/*
+ * Reseeding here keeps it off the request path. The period wakes the loop
+ * for reseeds that fall due by time alone, and retries failed ones.
+ */
+static void reseed_rng(void) {
+    if (device->RngReseedDue()) {
+        device->ReseedRng();
+    }
+}
+
+static const keymaster_idle_task kIdleTasks[] = {
+        {"entropy pool refill", 0, entropy_pool_pending, refill_entropy_pool},
+        {"RNG reseed", KEYMASTER_RNG_RESEED_PERIOD_MS, rng_reseed_pending,
+         reseed_rng},
+        {"key pool refill", 0, key_pool_pending, refill_key_pool},
+};
+
+static uint64_t idle_task_due_us[TABLE_SIZE(kIdleTasks)];
+static size_t next_idle_task;
+
+/*
+ * Returns the number of milliseconds until task |i| is due, 0 if it is due
+ * now, or KM_WAIT_FOREVER if it has nothing to do.
+ */
+static uint32_t idle_task_wait_ms(size_t i, uint64_t now) {
+    const keymaster_idle_task& task = kIdleTasks[i];
+    if (task.pending()) {
+        return 0;
+    }
+    if (!task.period_ms) {
+        return KM_WAIT_FOREVER;
+    }
+    if (idle_task_due_us[i] <= now) {
+        return 0;
+    }
+    uint64_t wait_ms = (idle_task_due_us[i] - now + 999) / 1000;
+    return wait_ms < KM_WAIT_FOREVER ? wait_ms : KM_WAIT_FOREVER - 1;
+}
+
+/*
+ * Returns how long the event loop may sleep before some task is due.
+ */
+static uint32_t idle_wait_ms(void) {
+    uint64_t now = now_us();
+    uint32_t wait_ms = KM_WAIT_FOREVER;
+    for (size_t i = 0; i < TABLE_SIZE(kIdleTasks) && wait_ms; i++) {
+        uint32_t task_wait_ms = idle_task_wait_ms(i, now);
+        if (task_wait_ms < wait_ms) {
+            wait_ms = task_wait_ms;
+        }
+    }
+    return wait_ms;
+}
+
+/*
+ * Runs one slice of the next due task, if any.
+ */
+static void run_idle_task(void) {
+    uint64_t now = now_us();
+    for (size_t n = 0; n < TABLE_SIZE(kIdleTasks); n++) {
+        size_t i = (next_idle_task + n) % TABLE_SIZE(kIdleTasks);
+        if (idle_task_wait_ms(i, now) != 0) {
+            continue;
+        }
+        const keymaster_idle_task& task = kIdleTasks[i];
+        LOG_D("Running %s", task.name);
+        task.run_slice();
+        idle_task_due_us[i] = now_us() + task.period_ms * 1000ULL;
+        next_idle_task = i + 1;
+        return;
+    }
+}
+
+/*
+ * Gives the next scheduled channel a turn: up to KEYMASTER_MSGS_PER_TURN of
+ * its messages are handled, and it goes back to the end of a run queue if
+ * more are waiting. The turn ends early after an expensive request, or before
+ * one if another channel has a cheap request waiting. When no channel has
+ * requests waiting, the turn goes to a slice of housekeeping instead.
+ */
+static void run_scheduled_turn(void) {
+    keymaster_chan_ctx* ctx = next_scheduled_chan();
+    if (ctx == NULL) {
+        run_idle_task();
+        return;
+    }
+
+    for (int i = 0; i < KEYMASTER_MSGS_PER_TURN; i++) {
+        bool expensive = ctx->next_cost == KM_COST_EXPENSIVE;
+        long rc = handle_msg(ctx);
+        if (rc == NO_ERROR && send_blocked(ctx)) {
+            /* rescheduled from IPC_HANDLE_POLL_SEND_UNBLOCKED */
+            return;
+        }
+        if (rc == NO_ERROR) {
+            rc = read_next_msg(ctx);
+        }
+        if (rc == ERR_NO_MSG) {
+            return;
+        }
+        if (rc != NO_ERROR) {
+            /* report an error and close channel */
+            LOG_E("failed (%d) to handle event on channel %d", rc, ctx->chan);
+            keymaster_ctx_close(ctx);
+            return;
+        }
+        if (expensive || (ctx->next_cost == KM_COST_EXPENSIVE &&
+                          run_queue_cheap.head)) {
+            break;
+        }
+    }
+    schedule_chan(ctx);
 }
 
 static void keymaster_port_handler(const uevent_t* ev,
@@ -755,6 +1931,36 @@ static void dispatch_event(const uevent_t* ev) {
     return;
 }
 
+/*
+ * Hands pending events to their handlers. Waits for the first one only if no
+ * channel is waiting for a turn, and then no longer than until the next
+ * housekeeping task is due. Returns once no events are pending. Channels
+ * holding a turn take their further messages into ctx->held_msgs, so their
+ * level-triggered IPC_HANDLE_POLL_MSG does not keep the loop going.
+ */
+static long collect_events(void) {
+    bool busy = run_queue_secure.head || run_queue_cheap.head ||
+                run_queue_expensive.head;
+    uint32_t timeout_ms = busy ? 0 : idle_wait_ms();
+    uevent_t event;
+
+    for (;;) {
+        event.handle = INVALID_IPC_HANDLE;
+        event.event = 0;
+        event.cookie = NULL;
+
+        long rc = wait_any(&event, timeout_ms);
+        if (rc == ERR_TIMED_OUT) {
+            return NO_ERROR;
+        }
+        if (rc < 0) {
+            return rc;
+        }
+        dispatch_event(&event);
+        timeout_ms = 0;
+    }
+}
+
 static long keymaster_ipc_init(keymaster_srv_ctx* ctx) {
     int rc;
 
@@ -776,7 +1982,8 @@ static long keymaster_ipc_init(keymaster_srv_ctx* ctx) {
     }
 
     /* initialize non-secure side service */
-    rc = port_create(KEYMASTER_PORT, 1, KEYMASTER_MAX_BUFFER_LENGTH,
+    rc = port_create(KEYMASTER_PORT, KEYMASTER_MAX_IN_FLIGHT,
+                     KEYMASTER_MAX_MESSAGE_SIZE,
                      IPC_PORT_ALLOW_NS_CONNECT);
     if (rc < 0) {
         LOG_E("Failed (%d) to create port %s", rc, KEYMASTER_PORT);
@@ -796,9 +2003,13 @@ static long keymaster_ipc_init(keymaster_srv_ctx* ctx) {
     return NO_ERROR;
 }
 
+#ifdef KEYMASTER_HOST_BUILD
+/* The host build (host/rules.mk) runs the event loop on a thread of its own. */
+#define main keymaster_app_main
+#endif
+
 int main(void) {
     long rc;
-    uevent_t event;
 
     device = new TrustyKeymaster(new TrustyKeymasterContext, 16);
 
@@ -826,19 +2037,13 @@ int main(void) {
 
     /* enter main event loop */
     while (true) {
-        event.handle = INVALID_IPC_HANDLE;
-        event.event = 0;
-        event.cookie = NULL;
-
-        rc = wait_any(&event, -1);
+        rc = collect_events();
         if (rc < 0) {
             LOG_E("wait_any failed (%d)", rc);
             break;
         }
 
-        if (rc == NO_ERROR) { /* got an event */
-            dispatch_event(&event);
-        }
+        run_scheduled_turn();
     }
 
     return 0;
@@ -16,9 +16,26 @@
 
 #pragma once
 
+#include <stdint.h>
+
 #define KEYMASTER_PORT "com.android.trusty.keymaster"
 #define KEYMASTER_MAX_BUFFER_LENGTH 4096
 
+/*
+ * Build-time ceiling on the message size of the non-secure port. Channels
+ * start at KEYMASTER_MAX_BUFFER_LENGTH and may agree on a larger size through
+ * KM_GET_VERSION, as described below keymaster_request_tag.
+ */
+#ifndef KEYMASTER_MAX_MESSAGE_SIZE
+#define KEYMASTER_MAX_MESSAGE_SIZE (4 * KEYMASTER_MAX_BUFFER_LENGTH)
+#endif
+
+// Largest request that may be reassembled from KM_REQUEST_FRAGMENT messages,
+// counting the keymaster_message header.
+#ifndef KEYMASTER_MAX_REQUEST_LENGTH
+#define KEYMASTER_MAX_REQUEST_LENGTH (4 * KEYMASTER_MAX_BUFFER_LENGTH)
+#endif
+
 // Commands
 enum keymaster_command {
     KEYMASTER_RESP_BIT = 1,
@@ -52,6 +69,13 @@ enum keymaster_command {
     KM_DESTROY_ATTESTATION_IDS = (24 << KEYMASTER_REQ_SHIFT),
     KM_IMPORT_WRAPPED_KEY = (25 << KEYMASTER_REQ_SHIFT),
 
+    // Trusty extensions.
+    KM_BATCH = (0x800 << KEYMASTER_REQ_SHIFT),
+    KM_ONESHOT_OPERATION = (0x801 << KEYMASTER_REQ_SHIFT),
+    KM_REQUEST_FRAGMENT = (0x802 << KEYMASTER_REQ_SHIFT),
+    KM_TAGGED = (0x803 << KEYMASTER_REQ_SHIFT),
+    KM_GET_STATS = (0x804 << KEYMASTER_REQ_SHIFT),
+
     // Bootloader calls.
     KM_SET_BOOT_PARAMS = (0x1000 << KEYMASTER_REQ_SHIFT),
     KM_PROVISION_KEYBOX = (0x1001 << KEYMASTER_REQ_SHIFT),
@@ -65,6 +89,127 @@ enum keymaster_command {
     KM_SET_PRODUCT_ID = (0x9000 << KEYMASTER_REQ_SHIFT)
 };
 
+/**
+ * keymaster_batch_entry - Header of one sub-command of a KM_BATCH message
+ * @payload_size: size of the payload following this header
+ * @cmd: the sub-command, one of keymaster_command
+ *
+ * A KM_BATCH request payload is a sequence of entries, each a header followed
+ * by the serialized request of @cmd. The entries are dispatched in order and
+ * answered by a single KM_BATCH response whose payload holds one entry per
+ * sub-command, in the same format, with KEYMASTER_RESP_BIT set in @cmd. A
+ * sub-command that fails before reaching keymaster is answered with a bare
+ * keymaster_error_t, as a stand-alone command would be.
+ *
+ * An UPDATE, FINISH or ABORT entry whose operation handle is zero is given
+ * the handle returned by the most recent successful BEGIN in the same batch,
+ * so a whole operation can be sent at once. Batches do not nest.
+ */
+struct keymaster_batch_entry {
+    uint32_t payload_size;
+    uint32_t cmd;
+};
+
+#define KEYMASTER_MAX_BATCH_ENTRIES 16
+
+/**
+ * keymaster_request_tag - Header of a KM_TAGGED message
+ * @request_id: chosen by the client, echoed in the response
+ * @cmd: the command carried, one of keymaster_command
+ *
+ * A KM_TAGGED request payload is this header followed by the serialized
+ * request of @cmd. The response is a KM_TAGGED message whose payload starts
+ * with the same header, with KEYMASTER_RESP_BIT set in @cmd, followed by the
+ * response of @cmd. This lets a client keep up to KEYMASTER_MAX_IN_FLIGHT
+ * requests queued on the non-secure port and match up the replies, which come
+ * back in request order. A tagged request may itself be sent in fragments.
+ */
+struct keymaster_request_tag {
+    uint32_t request_id;
+    uint32_t cmd;
+};
+
+/*
+ * Message size negotiation. GetVersionRequest serializes to nothing, so a
+ * plain KM_GET_VERSION has an empty payload and gets a bare
+ * GetVersionResponse. A client that can handle larger messages sends a raw
+ * uint32_t, the largest message size it accepts, as the whole KM_GET_VERSION
+ * payload. The TA clamps it to [KEYMASTER_MAX_BUFFER_LENGTH,
+ * KEYMASTER_MAX_MESSAGE_SIZE] and answers with the serialized
+ * GetVersionResponse followed by the agreed size as a raw uint32_t. The agreed
+ * size holds for every later message on the channel in both directions, and
+ * a later KM_GET_VERSION may change it again. If the TA cannot allocate
+ * buffers for the requested size it answers with the current one.
+ */
+
+/*
+ * Number of messages a client may have queued on the non-secure port.
+ */
+#ifndef KEYMASTER_MAX_IN_FLIGHT
+#define KEYMASTER_MAX_IN_FLIGHT 4
+#endif
+
+/*
+ * Number of latency buckets in keymaster_command_stats. Bucket 0 counts calls
+ * that took under 2us, bucket i (i > 0) those that took [2^i, 2^(i+1)) us,
+ * and the last bucket also takes everything slower.
+ */
+#define KEYMASTER_STATS_LATENCY_BUCKETS 16
+
+// Flag for the KM_GET_STATS request: zero the counters once they are read.
+#define KEYMASTER_STATS_RESET (1 << 0)
+
+/**
+ * keymaster_stats_header - Header of a KM_GET_STATS response
+ * @elapsed_us: time since the counters were last reset, or since boot
+ * @num_commands: number of keymaster_command_stats entries that follow
+ * @reserved: zero
+ *
+ * The request payload is empty or a uint32_t of KEYMASTER_STATS_* flags. The
+ * response holds this header followed by one entry for every command that has
+ * been called since the counters were last reset. Only the non-secure port
+ * answers KM_GET_STATS, and it does so in any state of the TA.
+ */
+struct keymaster_stats_header {
+    uint64_t elapsed_us;
+    uint32_t num_commands;
+    uint32_t reserved;
+};
+
+/**
+ * keymaster_command_stats - Counters of one command in a KM_GET_STATS reply
+ * @cmd: the command, one of keymaster_command
+ * @calls: number of requests for @cmd, including the ones that failed
+ * @errors: requests rejected by the TA or answered with a keymaster error
+ * @reserved: zero
+ * @request_bytes: total size of the request payloads
+ * @response_bytes: total size of the response payloads
+ * @total_latency_us: total time spent dispatching @cmd
+ * @latency_hist: calls by dispatch time, see KEYMASTER_STATS_LATENCY_BUCKETS
+ *
+ * Sub-commands of a KM_BATCH are counted under their own command as well as
+ * under KM_BATCH.
+ */
+struct keymaster_command_stats {
+    uint32_t cmd;
+    uint32_t calls;
+    uint32_t errors;
+    uint32_t reserved;
+    uint64_t request_bytes;
+    uint64_t response_bytes;
+    uint64_t total_latency_us;
+    uint32_t latency_hist[KEYMASTER_STATS_LATENCY_BUCKETS];
+};
+
+/*
+ * Requests larger than one message are sent as a run of KM_REQUEST_FRAGMENT
+ * messages carrying consecutive pieces of the serialized request, followed by
+ * a message with the real command and the last piece. Fragments are not
+ * answered; the final message gets the usual response for the reassembled
+ * request. A request that grows past KEYMASTER_MAX_REQUEST_LENGTH is dropped
+ * and answered with KM_ERROR_INVALID_INPUT_LENGTH.
+ */
+
 #ifdef __ANDROID__
 
 /**
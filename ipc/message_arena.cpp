@@ -0,0 +1,128 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "message_arena.h"
+
+#include <string.h>
+
+#include <new>
+
+#include <keymaster/android_keymaster_utils.h>
+
+namespace keymaster {
+
+namespace {
+
+const size_t kMinCapacity = 256;
+
+}  // anonymous namespace
+
+MessageArena* MessageArena::list_head_ = nullptr;
+
+MessageArena::MessageArena() {
+    next_ = list_head_;
+    if (next_)
+        next_->prev_ = this;
+    list_head_ = this;
+}
+
+MessageArena::~MessageArena() {
+    Shrink(0);
+    if (prev_)
+        prev_->next_ = next_;
+    else
+        list_head_ = next_;
+    if (next_)
+        next_->prev_ = prev_;
+}
+
+uint8_t* MessageArena::Append(size_t size) {
+    if (size > capacity_ - size_) {
+        size_t needed = size_ + size;
+        if (needed < size_)
+            return nullptr;
+        if (!Grow(needed)) {
+            ShrinkOthers(this);
+            if (!Grow(needed))
+                return nullptr;
+        }
+    }
+    uint8_t* region = buf_ + size_;
+    size_ += size;
+    return region;
+}
+
+void MessageArena::Truncate(size_t size) {
+    if (size >= size_)
+        return;
+    memset_s(buf_ + size, 0, size_ - size);
+    size_ = size;
+}
+
+void MessageArena::Consume(size_t size) {
+    if (size >= size_) {
+        Reset();
+        return;
+    }
+    if (size == 0)
+        return;
+    memmove(buf_, buf_ + size, size_ - size);
+    Truncate(size_ - size);
+}
+
+void MessageArena::Shrink(size_t max_capacity) {
+    Reset();
+    if (capacity_ <= max_capacity)
+        return;
+    delete[] buf_;
+    buf_ = nullptr;
+    capacity_ = 0;
+}
+
+/* Growth doubles the capacity so a run of appends stays linear. */
+bool MessageArena::Grow(size_t min_capacity) {
+    size_t capacity = capacity_ ? capacity_ : kMinCapacity;
+    while (capacity < min_capacity) {
+        if (capacity * 2 < capacity)
+            return false;
+        capacity *= 2;
+    }
+
+    uint8_t* buf = new (std::nothrow) uint8_t[capacity];
+    if (!buf)
+        return false;
+    if (size_) {
+        memcpy(buf, buf_, size_);
+        memset_s(buf_, 0, size_);
+    }
+    delete[] buf_;
+    buf_ = buf;
+    capacity_ = capacity;
+    return true;
+}
+
+/*
+ * Only arenas with no pending contents are released: the others belong to a
+ * dispatch in progress further up the stack.
+ */
+void MessageArena::ShrinkOthers(MessageArena* except) {
+    for (MessageArena* arena = list_head_; arena; arena = arena->next_) {
+        if (arena != except && arena->size_ == 0)
+            arena->Shrink(0);
+    }
+}
+
+}  // namespace keymaster
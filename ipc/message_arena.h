@@ -0,0 +1,97 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Capacity an idle arena may keep between commands. Messages larger than this
+ * (attestation chains, reassembled requests) are released once handled.
+ */
+#ifndef KEYMASTER_MESSAGE_ARENA_RETAIN_BYTES
+#define KEYMASTER_MESSAGE_ARENA_RETAIN_BYTES 4096
+#endif
+
+namespace keymaster {
+
+/*
+ * Growable buffer that a channel assembles messages in: responses as they are
+ * serialized, and requests that arrive in several fragments. The storage is
+ * kept at its high-water mark (up to the retain limit) so steady-state
+ * commands do not allocate. Messages may hold key material, so the bytes of
+ * the previous one are wiped before the arena is reused or released.
+ *
+ * All live arenas are linked together; when one of them fails to grow, the
+ * idle storage of the others is released and the allocation retried.
+ */
+class MessageArena {
+public:
+    MessageArena();
+    ~MessageArena();
+
+    /*
+     * Extends the contents by |size| bytes and returns a pointer to the new
+     * region, or nullptr if the arena could not grow. Pointers returned
+     * earlier are invalidated whenever the arena grows, so callers that
+     * append more than once should remember offsets instead.
+     */
+    uint8_t* Append(size_t size);
+
+    /*
+     * Drops the contents past |size|, wiping them.
+     */
+    void Truncate(size_t size);
+
+    /*
+     * Drops the first |size| bytes of the contents and moves the rest to the
+     * front of the arena, wiping the bytes left behind.
+     */
+    void Consume(size_t size);
+
+    /*
+     * Wipes the contents and empties the arena, keeping its storage.
+     */
+    void Reset() { Truncate(0); }
+
+    /*
+     * Resets the arena and frees its storage if it is larger than
+     * |max_capacity|.
+     */
+    void Shrink(size_t max_capacity);
+
+    uint8_t* data() { return buf_; }
+    size_t size() const { return size_; }
+    size_t capacity() const { return capacity_; }
+
+private:
+    bool Grow(size_t min_capacity);
+    static void ShrinkOthers(MessageArena* except);
+
+    uint8_t* buf_ = nullptr;
+    size_t size_ = 0;
+    size_t capacity_ = 0;
+    MessageArena* prev_ = nullptr;
+    MessageArena* next_ = nullptr;
+
+    static MessageArena* list_head_;
+
+    MessageArena(const MessageArena&) = delete;
+    void operator=(const MessageArena&) = delete;
+};
+
+}  // namespace keymaster
@@ -15,7 +15,10 @@
 
 CUR_DIR := $(GET_LOCAL_DIR)
 
-MODULE_SRCS += $(CUR_DIR)/keymaster_ipc.cpp
+MODULE_SRCS += \
+	$(CUR_DIR)/command_stats.cpp \
+	$(CUR_DIR)/keymaster_ipc.cpp \
+	$(CUR_DIR)/message_arena.cpp
 
 MODULE_DEPS += interface/keymaster
 
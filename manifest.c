@@ -25,7 +25,16 @@ trusty_app_manifest_t TRUSTY_APP_MANIFEST_ATTRS trusty_app_manifest = {
 
         /* optional configuration options here */
         {
-                /* openssl need a larger heap */
+                /*
+                 * openssl need a larger heap. Besides BoringSSL's working
+                 * memory for RSA, the heap holds these resident budgets:
+                 *  - decrypted key cache: KEYMASTER_KEY_CACHE_BYTES (8KB)
+                 *  - attestation bundle cache: two slots, up to 8KB
+                 *  - pre-generated key pool: about 2.7KB
+                 *  - per channel: a receive buffer of the agreed message
+                 *    size, up to 16KB, and while the client is slow to
+                 *    read, the unsent rest of one response
+                 */
                 TRUSTY_APP_CONFIG_MIN_HEAP_SIZE(24 * 4096),
 
                 /* openssl need a larger stack */
@@ -453,6 +453,11 @@ keymaster_error_t ParseKeyboxToStorage(
        LOG_E("failed(%d) to get the prikey with algo(%d)", error, algorithm);
        return KM_ERROR_UNKNOWN_ERROR;
     }
+    /* stage the key and the whole chain so the slot lands in one commit */
+    StorageTransaction transaction;
+    if (transaction.error() != KM_ERROR_OK) {
+        return KM_ERROR_UNKNOWN_ERROR;
+    }
     bool exists;
     error = AttestationKeyExists(key_slot, &exists);
     if (error != KM_ERROR_OK) {
@@ -509,6 +514,11 @@ keymaster_error_t ParseKeyboxToStorage(
         }
     }
 
+    error = transaction.Commit();
+    if (error != KM_ERROR_OK) {
+        LOG_E("failed(%d) to commit the keybox with algo(%d)", error, algorithm);
+        return KM_ERROR_UNKNOWN_ERROR;
+    }
     return KM_ERROR_OK;
 }
 
@@ -58,6 +58,9 @@ MODULE_SRCS += \
 	$(LOCAL_DIR)/manifest.c \
 	$(LOCAL_DIR)/openssl_keymaster_enforcement.cpp \
 	$(LOCAL_DIR)/test_attestation_keys.cpp \
+	$(LOCAL_DIR)/trusty_entropy_pool.cpp \
+	$(LOCAL_DIR)/trusty_key_cache.cpp \
+	$(LOCAL_DIR)/trusty_key_pool.cpp \
 	$(LOCAL_DIR)/trusty_keymaster.cpp \
 	$(LOCAL_DIR)/trusty_keymaster_context.cpp \
 	$(LOCAL_DIR)/trusty_keymaster_enforcement.cpp \
@@ -30,13 +30,19 @@ namespace keymaster {
 
 namespace {
 
-// Name of the attestation key file is kAttestKeyPrefix.%algorithm, where
-// algorithm is either "ec" or "rsa".
+// The attestation key and certificate chain of a slot are kept together in a
+// bundle file named kAttestBundlePrefix.%algorithm, where algorithm is e.g.
+// "ec" or "rsa". The file is a BundleHeader followed by the blobs it points
+// at, so the whole slot is read with one open and one read.
+const char* kAttestBundlePrefix = "AttestBundle";
+const uint32_t kBundleMagic = 0x4c444e42;  // "BNDL"
+const uint32_t kBundleVersion = 1;
+
+// Legacy layout, only read to migrate a slot into its bundle. The key was in
+// kAttestKeyPrefix.%algorithm, the chain length in
+// kAttestKeyPrefix.%algorithm.length and each certificate in
+// kAttestCertPrefix.%algorithm.%index.
 const char* kAttestKeyPrefix = "AttestKey.";
-
-// Name of the attestation certificate file is
-// kAttestCertPrefix.%algorithm.%index, where index is the index within the
-// certificate chain.
 const char* kAttestCertPrefix = "AttestCert.";
 
 const char* kAttestUuidFileName = "AttestUuid";
@@ -45,41 +51,79 @@ const char* kProductIdFileName = "ProductId";
 // Maximum file name size.
 static const int kStorageIdLengthMax = 64;
 
-// RAII wrapper for storage_session_t
-class StorageSession {
-public:
-    StorageSession() {
-        error_ = storage_open_session(&handle_, STORAGE_CLIENT_TP_PORT);
-        if (error_ < 0) {
-            LOG_E("Error: [%d] opening storage session", error_);
+// Storage session shared by every access from this app. It is opened on first
+// use and kept open, so reading a certificate chain does not set up a new
+// session with the storage proxy for every file.
+storage_session_t g_session;
+bool g_session_open = false;
+
+int OpenSharedSession(storage_session_t* session) {
+    if (!g_session_open) {
+        int rc = storage_open_session(&g_session, STORAGE_CLIENT_TP_PORT);
+        if (rc < 0) {
+            LOG_E("Error: [%d] opening storage session", rc);
+            return rc;
         }
+        g_session_open = true;
     }
-    ~StorageSession() {
-        if (error_ < 0) {
-            return;
-        }
-        storage_close_session(handle_);
-        error_ = -EINVAL;
+    *session = g_session;
+    return 0;
+}
+
+void CloseSharedSession() {
+    if (!g_session_open) {
+        return;
     }
+    storage_close_session(g_session);
+    g_session_open = false;
+}
 
-    int error() const { return error_; }
-    storage_session_t handle() { return handle_; }
+// Set between BeginStorageTransaction() and its commit or abort. Writes and
+// deletes are then left pending in the shared session instead of being
+// committed one by one. |g_transaction_lost| records that the session was
+// dropped mid-transaction, so the staged changes are gone.
+bool g_in_transaction = false;
+bool g_transaction_lost = false;
 
-private:
-    storage_session_t handle_ = 0;
-    int error_ = -EINVAL;
-};
+uint32_t StorageOpFlags() {
+    return g_in_transaction ? 0 : STORAGE_OP_COMPLETE;
+}
+
+// Runs |op| on the shared session. If the storage proxy has dropped the
+// channel (e.g. it restarted), the session is reopened and |op| retried once.
+// Inside a transaction there is nothing to retry against: the pending changes
+// went with the old session, so the transaction is marked lost instead.
+template <typename Op>
+int RunStorageOp(Op op) {
+    if (g_transaction_lost) {
+        return ERR_CHANNEL_CLOSED;
+    }
+    int rc = ERR_CHANNEL_CLOSED;
+    for (int attempt = 0; attempt < 2 && rc == ERR_CHANNEL_CLOSED; attempt++) {
+        storage_session_t session;
+        rc = OpenSharedSession(&session);
+        if (rc < 0) {
+            return rc;
+        }
+        rc = op(session);
+        if (rc == ERR_CHANNEL_CLOSED) {
+            LOG_E("Storage channel closed, reopening session", 0);
+            CloseSharedSession();
+            if (g_in_transaction) {
+                g_transaction_lost = true;
+                break;
+            }
+        }
+    }
+    return rc;
+}
 
 // RAII wrapper for file_handle_t
 class FileHandle {
 public:
-    FileHandle(const char* filename, int flags) {
-        if (session_.error() == 0) {
-            error_ = storage_open_file(session_.handle(), &handle_,
-                                       const_cast<char*>(filename), flags, 0);
-        } else {
-            error_ = session_.error();
-        }
+    FileHandle(storage_session_t session, const char* filename, int flags) {
+        error_ = storage_open_file(session, &handle_,
+                                   const_cast<char*>(filename), flags, 0);
     }
     ~FileHandle() {
         if (error_ != 0) {
@@ -92,18 +136,19 @@ public:
     file_handle_t handle() { return handle_; }
 
 private:
-    StorageSession session_;
     int error_ = -EINVAL;
     file_handle_t handle_ = 0;
 };
 
 bool SecureStorageWrite(const char* filename, const void* data, uint32_t size) {
-    FileHandle file(filename,
-                    STORAGE_FILE_OPEN_CREATE | STORAGE_FILE_OPEN_TRUNCATE);
-    if (file.error() < 0) {
-        return false;
-    }
-    int rc = storage_write(file.handle(), 0, data, size, STORAGE_OP_COMPLETE);
+    int rc = RunStorageOp([&](storage_session_t session) -> int {
+        FileHandle file(session, filename,
+                        STORAGE_FILE_OPEN_CREATE | STORAGE_FILE_OPEN_TRUNCATE);
+        if (file.error() < 0) {
+            return file.error();
+        }
+        return storage_write(file.handle(), 0, data, size, StorageOpFlags());
+    });
     if (rc < 0) {
         LOG_E("Error: [%d] writing storage object '%s'", rc, filename);
         return false;
@@ -116,11 +161,13 @@ bool SecureStorageWrite(const char* filename, const void* data, uint32_t size) {
 }
 
 bool SecureStorageRead(const char* filename, void* data, uint32_t size) {
-    FileHandle file(filename, STORAGE_FILE_OPEN_CREATE);
-    if (file.error() < 0) {
-        return false;
-    }
-    int rc = storage_read(file.handle(), 0, data, size);
+    int rc = RunStorageOp([&](storage_session_t session) -> int {
+        FileHandle file(session, filename, STORAGE_FILE_OPEN_CREATE);
+        if (file.error() < 0) {
+            return file.error();
+        }
+        return storage_read(file.handle(), 0, data, size);
+    });
     if (rc < 0) {
         LOG_E("Error: [%d] reading storage object '%s'", rc, filename);
         return false;
@@ -133,11 +180,13 @@ bool SecureStorageRead(const char* filename, void* data, uint32_t size) {
 }
 
 bool SecureStorageGetFileSize(const char* filename, uint64_t* size) {
-    FileHandle file(filename, STORAGE_FILE_OPEN_CREATE);
-    if (file.error() < 0) {
-        return false;
-    }
-    int rc = storage_get_file_size(file.handle(), size);
+    int rc = RunStorageOp([&](storage_session_t session) -> int {
+        FileHandle file(session, filename, STORAGE_FILE_OPEN_CREATE);
+        if (file.error() < 0) {
+            return file.error();
+        }
+        return storage_get_file_size(file.handle(), size);
+    });
     if (rc < 0) {
         LOG_E("Error: [%d] reading storage object '%s'", rc, filename);
         return false;
@@ -146,12 +195,9 @@ bool SecureStorageGetFileSize(const char* filename, uint64_t* size) {
 }
 
 bool SecureStorageDeleteFile(const char* filename) {
-    StorageSession session;
-    if (session.error() < 0) {
-        return false;
-    }
-    int rc = storage_delete_file(session.handle(), filename,
-                                 STORAGE_OP_COMPLETE);
+    int rc = RunStorageOp([&](storage_session_t session) -> int {
+        return storage_delete_file(session, filename, StorageOpFlags());
+    });
     if (rc < 0 && rc != ERR_NOT_FOUND) {
         LOG_E("Error: [%d] deleting storage object '%s'", rc, filename);
         return false;
@@ -159,6 +205,51 @@ bool SecureStorageDeleteFile(const char* filename) {
     return true;
 }
 
+// Reads all of |filename| with a single open. A missing file reads as empty.
+bool SecureStorageReadFile(const char* filename,
+                           UniquePtr<uint8_t[]>* data,
+                           uint32_t* size) {
+    int rc = RunStorageOp([&](storage_session_t session) -> int {
+        *size = 0;
+        FileHandle file(session, filename, 0);
+        if (file.error() == ERR_NOT_FOUND) {
+            return 0;
+        }
+        if (file.error() < 0) {
+            return file.error();
+        }
+        storage_off_t file_size;
+        int rc = storage_get_file_size(file.handle(), &file_size);
+        if (rc < 0) {
+            return rc;
+        }
+        if (file_size == 0) {
+            return 0;
+        }
+        if (file_size > UINT32_MAX) {
+            return ERR_TOO_BIG;
+        }
+        data->reset(new uint8_t[file_size]);
+        if (!data->get()) {
+            return ERR_NO_MEMORY;
+        }
+        ssize_t read = storage_read(file.handle(), 0, data->get(), file_size);
+        if (read < 0) {
+            return read;
+        }
+        if (static_cast<storage_off_t>(read) != file_size) {
+            return ERR_IO;
+        }
+        *size = file_size;
+        return 0;
+    });
+    if (rc < 0) {
+        LOG_E("Error: [%d] reading storage object '%s'", rc, filename);
+        return false;
+    }
+    return true;
+}
+
 const char* GetKeySlotStr(AttestationKeySlot key_slot) {
     switch (key_slot) {
     case AttestationKeySlot::kRsa:
@@ -184,47 +275,492 @@ const char* GetKeySlotStr(AttestationKeySlot key_slot) {
     }
 }
 
-}  //  unnamed namespace
+struct BundleEntry {
+    uint32_t offset;
+    uint32_t size;
+};
 
-keymaster_error_t WriteKeyToStorage(AttestationKeySlot key_slot,
-                                    const uint8_t* key,
-                                    uint32_t key_size) {
-    UniquePtr<char[]> key_file(new char[kStorageIdLengthMax]);
-    snprintf(key_file.get(), kStorageIdLengthMax, "%s.%s", kAttestKeyPrefix,
+struct BundleHeader {
+    uint32_t magic;
+    uint32_t version;
+    BundleEntry key;
+    uint32_t cert_count;
+    BundleEntry certs[kMaxCertChainLength];
+};
+
+void BundleFileName(AttestationKeySlot key_slot, char* name) {
+    snprintf(name, kStorageIdLengthMax, "%s.%s", kAttestBundlePrefix,
              GetKeySlotStr(key_slot));
-    if (!SecureStorageWrite(key_file.get(), key, key_size)) {
+}
+
+bool CopyBlob(KeymasterKeyBlob* blob, const uint8_t* data, uint32_t size) {
+    if (size == 0) {
+        *blob = KeymasterKeyBlob();
+        return true;
+    }
+    if (!blob->Reset(size)) {
+        return false;
+    }
+    memcpy(blob->writable_data(), data, size);
+    return true;
+}
+
+// Deletes every file of the legacy layout of |key_slot|.
+bool DeleteLegacyFiles(AttestationKeySlot key_slot) {
+    UniquePtr<char[]> file(new char[kStorageIdLengthMax]);
+    snprintf(file.get(), kStorageIdLengthMax, "%s.%s", kAttestKeyPrefix,
+             GetKeySlotStr(key_slot));
+    if (!SecureStorageDeleteFile(file.get())) {
+        return false;
+    }
+    snprintf(file.get(), kStorageIdLengthMax, "%s.%s.length", kAttestKeyPrefix,
+             GetKeySlotStr(key_slot));
+    if (!SecureStorageDeleteFile(file.get())) {
+        return false;
+    }
+    for (int i = 0; i < kMaxCertChainLength; i++) {
+        snprintf(file.get(), kStorageIdLengthMax, "%s.%s.%d",
+                 kAttestCertPrefix, GetKeySlotStr(key_slot), i);
+        if (!SecureStorageDeleteFile(file.get())) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// In-memory copy of a slot's bundle file.
+class AttestationBundle {
+public:
+    // Loads the bundle of |key_slot| from storage. If there is none yet, data
+    // stored in the legacy layout is moved into a new bundle. A slot without
+    // any data loads as an empty bundle. Callers go through ReadBundle or
+    // LoadBundleForUpdate, which consult the cache first.
+    keymaster_error_t Load(AttestationKeySlot key_slot);
+
+    // Writes the bundle back to |key_slot|, or deletes its file if empty.
+    keymaster_error_t Store(AttestationKeySlot key_slot) const;
+
+    const KeymasterKeyBlob& key() const { return key_; }
+    uint32_t cert_count() const { return cert_count_; }
+    const KeymasterKeyBlob& cert(uint32_t index) const {
+        return certs_[index];
+    }
+
+    bool SetKey(const uint8_t* key, uint32_t key_size) {
+        return CopyBlob(&key_, key, key_size);
+    }
+    // |index| may be at most cert_count(), which appends to the chain.
+    bool SetCert(uint32_t index, const uint8_t* cert, uint32_t cert_size);
+    void TruncateChain(uint32_t length);
+
+    bool CopyFrom(const AttestationBundle& other);
+
+private:
+    bool Parse(const uint8_t* data, uint32_t size);
+    keymaster_error_t LoadLegacy(AttestationKeySlot key_slot, bool* found);
+    keymaster_error_t Migrate(AttestationKeySlot key_slot);
+
+    KeymasterKeyBlob key_;
+    KeymasterKeyBlob certs_[kMaxCertChainLength];
+    uint32_t cert_count_ = 0;
+};
+
+// Bundles of the slots used for key attestation, kept after the first load so
+// GenerateAttestation does not go to RPMB every time. An unprovisioned slot is
+// cached as an empty bundle. Entries are dropped by every write to their slot
+// and are only filled outside transactions, so staged data is never cached.
+//
+// A provisioned slot holds a DER private key and up to kMaxCertChainLength
+// certificates, about 4KB, so the cache keeps up to 8KB of the TA heap
+// resident (see the heap budget in manifest.c). Readers use the cached bundle
+// in place rather than copying it.
+struct CachedBundle {
+    AttestationKeySlot key_slot;
+    bool valid;
+    AttestationBundle bundle;
+};
+
+CachedBundle g_bundle_cache[] = {
+        {AttestationKeySlot::kRsa, false, {}},
+        {AttestationKeySlot::kEcdsa, false, {}},
+};
+
+CachedBundle* FindCachedBundle(AttestationKeySlot key_slot) {
+    for (CachedBundle& entry : g_bundle_cache) {
+        if (entry.key_slot == key_slot) {
+            return &entry;
+        }
+    }
+    return nullptr;
+}
+
+void InvalidateCachedBundle(AttestationKeySlot key_slot) {
+    CachedBundle* entry = FindCachedBundle(key_slot);
+    if (entry && entry->valid) {
+        entry->valid = false;
+        entry->bundle = AttestationBundle();
+    }
+}
+
+// Sets |*bundle| to the bundle of |key_slot| for reading. That is the cached
+// bundle when the slot is cached, and |storage| otherwise. |*bundle| stays
+// valid until the next write to the slot.
+keymaster_error_t ReadBundle(AttestationKeySlot key_slot,
+                             AttestationBundle* storage,
+                             const AttestationBundle** bundle) {
+    CachedBundle* cached = FindCachedBundle(key_slot);
+    if (cached && cached->valid) {
+        *bundle = &cached->bundle;
+        return KM_ERROR_OK;
+    }
+
+    bool cache = cached && !g_in_transaction;
+    AttestationBundle* target = cache ? &cached->bundle : storage;
+    keymaster_error_t error = target->Load(key_slot);
+    if (error != KM_ERROR_OK) {
+        if (cache) {
+            cached->bundle = AttestationBundle();
+        }
+        return error;
+    }
+    if (cache) {
+        cached->valid = true;
+    }
+    *bundle = target;
+    return KM_ERROR_OK;
+}
+
+// Loads a private copy of the bundle of |key_slot| for modification.
+keymaster_error_t LoadBundleForUpdate(AttestationKeySlot key_slot,
+                                      AttestationBundle* bundle) {
+    CachedBundle* cached = FindCachedBundle(key_slot);
+    if (cached && cached->valid) {
+        return bundle->CopyFrom(cached->bundle)
+                       ? KM_ERROR_OK
+                       : KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    }
+    return bundle->Load(key_slot);
+}
+
+keymaster_error_t AttestationBundle::Load(AttestationKeySlot key_slot) {
+    UniquePtr<char[]> bundle_file(new char[kStorageIdLengthMax]);
+    BundleFileName(key_slot, bundle_file.get());
+
+    UniquePtr<uint8_t[]> data;
+    uint32_t size;
+    if (!SecureStorageReadFile(bundle_file.get(), &data, &size)) {
         return KM_ERROR_UNKNOWN_ERROR;
     }
+    if (size != 0) {
+        // The file buffer is released as soon as the blobs are copied out,
+        // so it is never held alongside the cached copy.
+        bool parsed = Parse(data.get(), size);
+        data.reset();
+        if (!parsed) {
+            LOG_E("Error: malformed attestation bundle '%s'",
+                  bundle_file.get());
+            return KM_ERROR_UNKNOWN_ERROR;
+        }
+    } else {
+        bool found;
+        keymaster_error_t error = LoadLegacy(key_slot, &found);
+        if (error == KM_ERROR_OK && found) {
+            error = Migrate(key_slot);
+        }
+        if (error != KM_ERROR_OK) {
+            return error;
+        }
+    }
+    return KM_ERROR_OK;
+}
+
+keymaster_error_t AttestationBundle::Store(AttestationKeySlot key_slot) const {
+    UniquePtr<char[]> bundle_file(new char[kStorageIdLengthMax]);
+    BundleFileName(key_slot, bundle_file.get());
+    InvalidateCachedBundle(key_slot);
+
+    if (key_.key_material_size == 0 && cert_count_ == 0) {
+        if (!SecureStorageDeleteFile(bundle_file.get())) {
+            return KM_ERROR_UNKNOWN_ERROR;
+        }
+        return KM_ERROR_OK;
+    }
 
+    BundleHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = kBundleMagic;
+    header.version = kBundleVersion;
+    uint32_t offset = sizeof(header);
+    header.key.offset = offset;
+    header.key.size = key_.key_material_size;
+    offset += header.key.size;
+    header.cert_count = cert_count_;
+    for (uint32_t i = 0; i < cert_count_; i++) {
+        header.certs[i].offset = offset;
+        header.certs[i].size = certs_[i].key_material_size;
+        offset += header.certs[i].size;
+    }
+
+    UniquePtr<uint8_t[]> data(new uint8_t[offset]);
+    if (!data.get()) {
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    }
+    memcpy(data.get(), &header, sizeof(header));
+    if (header.key.size) {
+        memcpy(data.get() + header.key.offset, key_.key_material,
+               header.key.size);
+    }
+    for (uint32_t i = 0; i < cert_count_; i++) {
+        memcpy(data.get() + header.certs[i].offset, certs_[i].key_material,
+               header.certs[i].size);
+    }
+    if (!SecureStorageWrite(bundle_file.get(), data.get(), offset)) {
+        return KM_ERROR_UNKNOWN_ERROR;
+    }
     return KM_ERROR_OK;
 }
 
-KeymasterKeyBlob ReadKeyFromStorage(AttestationKeySlot key_slot,
-                                    keymaster_error_t* error) {
-    UniquePtr<char[]> key_file(new char[kStorageIdLengthMax]);
-    snprintf(key_file.get(), kStorageIdLengthMax, "%s.%s", kAttestKeyPrefix,
+bool AttestationBundle::SetCert(uint32_t index,
+                                const uint8_t* cert,
+                                uint32_t cert_size) {
+    if (index > cert_count_ || index >= kMaxCertChainLength) {
+        return false;
+    }
+    if (!CopyBlob(&certs_[index], cert, cert_size)) {
+        return false;
+    }
+    if (index == cert_count_) {
+        cert_count_++;
+    }
+    return true;
+}
+
+bool AttestationBundle::CopyFrom(const AttestationBundle& other) {
+    if (!CopyBlob(&key_, other.key_.key_material,
+                  other.key_.key_material_size)) {
+        return false;
+    }
+    TruncateChain(0);
+    for (uint32_t i = 0; i < other.cert_count_; i++) {
+        if (!SetCert(i, other.certs_[i].key_material,
+                     other.certs_[i].key_material_size)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void AttestationBundle::TruncateChain(uint32_t length) {
+    for (uint32_t i = length; i < cert_count_; i++) {
+        certs_[i] = KeymasterKeyBlob();
+    }
+    if (length < cert_count_) {
+        cert_count_ = length;
+    }
+}
+
+bool AttestationBundle::Parse(const uint8_t* data, uint32_t size) {
+    BundleHeader header;
+    if (size < sizeof(header)) {
+        return false;
+    }
+    memcpy(&header, data, sizeof(header));
+    if (header.magic != kBundleMagic || header.version != kBundleVersion ||
+        header.cert_count > kMaxCertChainLength) {
+        return false;
+    }
+
+    auto entry_valid = [size](const BundleEntry& entry) {
+        return entry.offset >= sizeof(BundleHeader) &&
+               static_cast<uint64_t>(entry.offset) + entry.size <= size;
+    };
+    if (!entry_valid(header.key) ||
+        !CopyBlob(&key_, data + header.key.offset, header.key.size)) {
+        return false;
+    }
+    for (uint32_t i = 0; i < header.cert_count; i++) {
+        if (!entry_valid(header.certs[i]) ||
+            !CopyBlob(&certs_[i], data + header.certs[i].offset,
+                      header.certs[i].size)) {
+            return false;
+        }
+    }
+    cert_count_ = header.cert_count;
+    return true;
+}
+
+keymaster_error_t AttestationBundle::LoadLegacy(AttestationKeySlot key_slot,
+                                                bool* found) {
+    UniquePtr<char[]> file(new char[kStorageIdLengthMax]);
+    UniquePtr<uint8_t[]> data;
+    uint32_t size;
+
+    *found = false;
+    snprintf(file.get(), kStorageIdLengthMax, "%s.%s", kAttestKeyPrefix,
              GetKeySlotStr(key_slot));
+    if (!SecureStorageReadFile(file.get(), &data, &size)) {
+        return KM_ERROR_UNKNOWN_ERROR;
+    }
+    if (!SetKey(data.get(), size)) {
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    }
+
+    uint32_t cert_chain_length = 0;
+    snprintf(file.get(), kStorageIdLengthMax, "%s.%s.length", kAttestKeyPrefix,
+             GetKeySlotStr(key_slot));
+    if (!SecureStorageReadFile(file.get(), &data, &size)) {
+        return KM_ERROR_UNKNOWN_ERROR;
+    }
+    if (size >= sizeof(cert_chain_length)) {
+        memcpy(&cert_chain_length, data.get(), sizeof(cert_chain_length));
+    }
+    if (cert_chain_length > kMaxCertChainLength) {
+        return KM_ERROR_UNKNOWN_ERROR;
+    }
+
+    for (uint32_t i = 0; i < cert_chain_length; i++) {
+        snprintf(file.get(), kStorageIdLengthMax, "%s.%s.%d",
+                 kAttestCertPrefix, GetKeySlotStr(key_slot), i);
+        if (!SecureStorageReadFile(file.get(), &data, &size) || size == 0) {
+            return KM_ERROR_UNKNOWN_ERROR;
+        }
+        if (!SetCert(i, data.get(), size)) {
+            return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+        }
+    }
+
+    *found = key_.key_material_size != 0 || cert_count_ != 0;
+    return KM_ERROR_OK;
+}
+
+// Writes the bundle and removes the legacy files in one commit, joining the
+// caller's transaction if there is one.
+keymaster_error_t AttestationBundle::Migrate(AttestationKeySlot key_slot) {
+    LOG_I("Migrating attestation slot '%s' to a bundle",
+          GetKeySlotStr(key_slot));
+    UniquePtr<StorageTransaction> transaction;
+    if (!g_in_transaction) {
+        transaction.reset(new StorageTransaction);
+        if (transaction->error() != KM_ERROR_OK) {
+            return transaction->error();
+        }
+    }
+    keymaster_error_t error = Store(key_slot);
+    if (error != KM_ERROR_OK) {
+        return error;
+    }
+    if (!DeleteLegacyFiles(key_slot)) {
+        return KM_ERROR_UNKNOWN_ERROR;
+    }
+    return transaction.get() ? transaction->Commit() : KM_ERROR_OK;
+}
+
+}  //  unnamed namespace
+
+keymaster_error_t BeginStorageTransaction() {
+    if (g_in_transaction) {
+        LOG_E("Error: storage transaction already in progress", 0);
+        return KM_ERROR_UNKNOWN_ERROR;
+    }
+    storage_session_t session;
+    if (OpenSharedSession(&session) < 0) {
+        return KM_ERROR_UNKNOWN_ERROR;
+    }
+    g_in_transaction = true;
+    g_transaction_lost = false;
+    return KM_ERROR_OK;
+}
+
+keymaster_error_t CommitStorageTransaction() {
+    if (!g_in_transaction) {
+        return KM_ERROR_UNKNOWN_ERROR;
+    }
+    bool lost = g_transaction_lost;
+    g_in_transaction = false;
+    g_transaction_lost = false;
+    if (lost) {
+        LOG_E("Error: storage transaction lost with its session", 0);
+        return KM_ERROR_UNKNOWN_ERROR;
+    }
 
-    uint64_t key_size_64;
-    if (!SecureStorageGetFileSize(key_file.get(), &key_size_64) ||
-        key_size_64 == 0) {
+    int rc = storage_end_transaction(g_session, true);
+    if (rc < 0) {
+        LOG_E("Error: [%d] committing storage transaction", rc);
+        if (rc == ERR_CHANNEL_CLOSED) {
+            CloseSharedSession();
+        }
+        return KM_ERROR_UNKNOWN_ERROR;
+    }
+    return KM_ERROR_OK;
+}
+
+void AbortStorageTransaction() {
+    if (!g_in_transaction) {
+        return;
+    }
+    if (!g_transaction_lost && g_session_open) {
+        int rc = storage_end_transaction(g_session, false);
+        if (rc == ERR_CHANNEL_CLOSED) {
+            CloseSharedSession();
+        }
+    }
+    g_in_transaction = false;
+    g_transaction_lost = false;
+}
+
+StorageTransaction::StorageTransaction() {
+    error_ = BeginStorageTransaction();
+}
+
+StorageTransaction::~StorageTransaction() {
+    if (error_ == KM_ERROR_OK && !done_) {
+        AbortStorageTransaction();
+    }
+}
+
+keymaster_error_t StorageTransaction::Commit() {
+    if (error_ != KM_ERROR_OK) {
+        return error_;
+    }
+    if (done_) {
+        return KM_ERROR_UNKNOWN_ERROR;
+    }
+    done_ = true;
+    return CommitStorageTransaction();
+}
+
+keymaster_error_t WriteKeyToStorage(AttestationKeySlot key_slot,
+                                    const uint8_t* key,
+                                    uint32_t key_size) {
+    AttestationBundle bundle;
+    keymaster_error_t error = LoadBundleForUpdate(key_slot, &bundle);
+    if (error != KM_ERROR_OK) {
+        return error;
+    }
+    if (!bundle.SetKey(key, key_size)) {
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    }
+    return bundle.Store(key_slot);
+}
+
+KeymasterKeyBlob ReadKeyFromStorage(AttestationKeySlot key_slot,
+                                    keymaster_error_t* error) {
+    AttestationBundle storage;
+    const AttestationBundle* bundle;
+    keymaster_error_t load_error = ReadBundle(key_slot, &storage, &bundle);
+    if (load_error != KM_ERROR_OK || bundle->key().key_material_size == 0) {
         if (error)
             *error = KM_ERROR_UNKNOWN_ERROR;
         return {};
     }
 
-    KeymasterKeyBlob result(key_size_64);
+    KeymasterKeyBlob result(bundle->key().key_material,
+                            bundle->key().key_material_size);
     if (result.key_material == nullptr) {
         if (error)
             *error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
         return {};
     }
-    if (!SecureStorageRead(key_file.get(), result.writable_data(),
-                           result.key_material_size)) {
-        if (error)
-            *error = KM_ERROR_UNKNOWN_ERROR;
-        return {};
-    }
     if (error)
         *error = KM_ERROR_OK;
     return result;
@@ -232,14 +768,12 @@ KeymasterKeyBlob ReadKeyFromStorage(AttestationKeySlot key_slot,
 
 keymaster_error_t AttestationKeyExists(AttestationKeySlot key_slot,
                                        bool* exists) {
-    UniquePtr<char[]> key_file(new char[kStorageIdLengthMax]);
-    snprintf(key_file.get(), kStorageIdLengthMax, "%s.%s", kAttestKeyPrefix,
-             GetKeySlotStr(key_slot));
-    uint64_t size;
-    if (!SecureStorageGetFileSize(key_file.get(), &size)) {
+    AttestationBundle storage;
+    const AttestationBundle* bundle;
+    if (ReadBundle(key_slot, &storage, &bundle) != KM_ERROR_OK) {
         return KM_ERROR_UNKNOWN_ERROR;
     }
-    *exists = size > 0;
+    *exists = bundle->key().key_material_size > 0;
     return KM_ERROR_OK;
 }
 
@@ -247,41 +781,31 @@ keymaster_error_t WriteCertToStorage(AttestationKeySlot key_slot,
                                      const uint8_t* cert,
                                      uint32_t cert_size,
                                      uint32_t index) {
-    UniquePtr<char[]> cert_file(new char[kStorageIdLengthMax]);
-    uint32_t cert_chain_length;
-    bool update_cert_chain_length = false;
-    if (ReadCertChainLength(key_slot, &cert_chain_length) != KM_ERROR_OK) {
+    AttestationBundle bundle;
+    if (LoadBundleForUpdate(key_slot, &bundle) != KM_ERROR_OK) {
         return KM_ERROR_UNKNOWN_ERROR;
     }
-    if (index > cert_chain_length) {
+    if (index > bundle.cert_count()) {
         return KM_ERROR_INVALID_ARGUMENT;
-    } else if (index == cert_chain_length) {
-        cert_chain_length += 1;
-        update_cert_chain_length = true;
     }
-
-    snprintf(cert_file.get(), kStorageIdLengthMax, "%s.%s.%d",
-             kAttestCertPrefix, GetKeySlotStr(key_slot), index);
-    if (!SecureStorageWrite(cert_file.get(), cert, cert_size)) {
+    if (index >= kMaxCertChainLength) {
         return KM_ERROR_UNKNOWN_ERROR;
     }
-    if (update_cert_chain_length &&
-        WriteCertChainLength(key_slot, cert_chain_length) != KM_ERROR_OK) {
-        return KM_ERROR_UNKNOWN_ERROR;
+    if (!bundle.SetCert(index, cert, cert_size)) {
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
     }
-    return KM_ERROR_OK;
+    return bundle.Store(key_slot);
 }
 
 keymaster_error_t ReadCertChainFromStorage(AttestationKeySlot key_slot,
                                            keymaster_cert_chain_t* cert_chain) {
-    UniquePtr<char[]> cert_file(new char[kStorageIdLengthMax]);
-    uint32_t cert_chain_length;
-    uint64_t cert_size;
-
-    if (ReadCertChainLength(key_slot, &cert_chain_length) != KM_ERROR_OK ||
-        cert_chain_length == 0) {
+    AttestationBundle storage;
+    const AttestationBundle* bundle;
+    if (ReadBundle(key_slot, &storage, &bundle) != KM_ERROR_OK ||
+        bundle->cert_count() == 0) {
         return KM_ERROR_UNKNOWN_ERROR;
     }
+    uint32_t cert_chain_length = bundle->cert_count();
     cert_chain->entry_count = cert_chain_length;
     cert_chain->entries = new keymaster_blob_t[cert_chain_length];
     if (!cert_chain->entries) {
@@ -290,71 +814,55 @@ keymaster_error_t ReadCertChainFromStorage(AttestationKeySlot key_slot,
     memset(cert_chain->entries, 0,
            sizeof(cert_chain->entries[0]) * cert_chain_length);
 
-    // Read |cert_chain_length| certs from storage
     for (uint32_t i = 0; i < cert_chain_length; i++) {
-        snprintf(cert_file.get(), kStorageIdLengthMax, "%s.%s.%d",
-                 kAttestCertPrefix, GetKeySlotStr(key_slot), i);
-        if (!SecureStorageGetFileSize(cert_file.get(), &cert_size) ||
-            cert_size == 0) {
+        const KeymasterKeyBlob& cert = bundle->cert(i);
+        if (cert.key_material_size == 0) {
             return KM_ERROR_UNKNOWN_ERROR;
         }
-        UniquePtr<uint8_t[]> cert_data(new uint8_t[cert_size]);
-        if (!cert_data.get()) {
+        uint8_t* cert_data =
+                dup_buffer(cert.key_material, cert.key_material_size);
+        if (!cert_data) {
             return KM_ERROR_MEMORY_ALLOCATION_FAILED;
         }
-        if (!SecureStorageRead(cert_file.get(), cert_data.get(), cert_size)) {
-            return KM_ERROR_UNKNOWN_ERROR;
-        }
-        cert_chain->entries[i].data_length = static_cast<uint32_t>(cert_size);
-        cert_chain->entries[i].data = cert_data.release();
+        cert_chain->entries[i].data_length = cert.key_material_size;
+        cert_chain->entries[i].data = cert_data;
     }
     return KM_ERROR_OK;
 }
 
 keymaster_error_t WriteCertChainLength(AttestationKeySlot key_slot,
                                        uint32_t cert_chain_length) {
-    UniquePtr<char[]> cert_chain_length_file(new char[kStorageIdLengthMax]);
-    snprintf(cert_chain_length_file.get(), kStorageIdLengthMax, "%s.%s.length",
-             kAttestKeyPrefix, GetKeySlotStr(key_slot));
     if (cert_chain_length > kMaxCertChainLength) {
         return KM_ERROR_UNKNOWN_ERROR;
     }
 
-    uint32_t current_cert_chain_length = 0;
-    if (ReadCertChainLength(key_slot, &current_cert_chain_length) !=
-                KM_ERROR_OK ||
-        cert_chain_length > current_cert_chain_length + 1) {
+    AttestationBundle bundle;
+    if (LoadBundleForUpdate(key_slot, &bundle) != KM_ERROR_OK) {
+        return KM_ERROR_UNKNOWN_ERROR;
+    }
+    if (cert_chain_length > bundle.cert_count() + 1) {
         LOG_E("Error: Cannot increase certificate chain length by more than 1.",
               0);
         return KM_ERROR_INVALID_ARGUMENT;
     }
-    if (!SecureStorageWrite(cert_chain_length_file.get(), &cert_chain_length,
-                            sizeof(uint32_t))) {
-        return KM_ERROR_UNKNOWN_ERROR;
+    // Growing the chain by one appends an empty certificate, to be filled in
+    // by WriteCertToStorage. Until then ReadCertChainFromStorage fails.
+    if (cert_chain_length > bundle.cert_count() &&
+        !bundle.SetCert(bundle.cert_count(), nullptr, 0)) {
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
     }
-    return KM_ERROR_OK;
+    bundle.TruncateChain(cert_chain_length);
+    return bundle.Store(key_slot);
 }
 
 keymaster_error_t ReadCertChainLength(AttestationKeySlot key_slot,
                                       uint32_t* cert_chain_length) {
-    UniquePtr<char[]> cert_chain_length_file(new char[kStorageIdLengthMax]);
-    snprintf(cert_chain_length_file.get(), kStorageIdLengthMax, "%s.%s.length",
-             kAttestKeyPrefix, GetKeySlotStr(key_slot));
-
-    uint64_t file_size;
-    if (!SecureStorageGetFileSize(cert_chain_length_file.get(), &file_size)) {
-        return KM_ERROR_UNKNOWN_ERROR;
-    }
-    if (file_size == 0) {
-        *cert_chain_length = 0;
-        return KM_ERROR_OK;
-    }
-
-    if (!SecureStorageRead(cert_chain_length_file.get(), cert_chain_length,
-                           sizeof(uint32_t)) ||
-        *cert_chain_length > kMaxCertChainLength) {
+    AttestationBundle storage;
+    const AttestationBundle* bundle;
+    if (ReadBundle(key_slot, &storage, &bundle) != KM_ERROR_OK) {
         return KM_ERROR_UNKNOWN_ERROR;
     }
+    *cert_chain_length = bundle->cert_count();
     return KM_ERROR_OK;
 }
 
@@ -385,33 +893,21 @@ keymaster_error_t ReadAttestationUuid(
 }
 
 keymaster_error_t DeleteKey(AttestationKeySlot key_slot) {
-    UniquePtr<char[]> key_file(new char[kStorageIdLengthMax]);
-    snprintf(key_file.get(), kStorageIdLengthMax, "%s.%s", kAttestKeyPrefix,
-             GetKeySlotStr(key_slot));
-    if (!SecureStorageDeleteFile(key_file.get())) {
+    AttestationBundle bundle;
+    if (LoadBundleForUpdate(key_slot, &bundle) != KM_ERROR_OK) {
         return KM_ERROR_UNKNOWN_ERROR;
     }
-    return KM_ERROR_OK;
+    bundle.SetKey(nullptr, 0);
+    return bundle.Store(key_slot);
 }
 
 keymaster_error_t DeleteCertChain(AttestationKeySlot key_slot) {
-    UniquePtr<char[]> cert_file(new char[kStorageIdLengthMax]);
-    uint32_t cert_chain_length;
-
-    if (ReadCertChainLength(key_slot, &cert_chain_length) != KM_ERROR_OK) {
+    AttestationBundle bundle;
+    if (LoadBundleForUpdate(key_slot, &bundle) != KM_ERROR_OK) {
         return KM_ERROR_UNKNOWN_ERROR;
     }
-    for (uint32_t i = 0; i < cert_chain_length; ++i) {
-        snprintf(cert_file.get(), kStorageIdLengthMax, "%s.%s.%d",
-                 kAttestCertPrefix, GetKeySlotStr(key_slot), i);
-        if (!SecureStorageDeleteFile(cert_file.get())) {
-            return KM_ERROR_UNKNOWN_ERROR;
-        }
-    }
-    if (WriteCertChainLength(key_slot, 0) != KM_ERROR_OK) {
-        return KM_ERROR_UNKNOWN_ERROR;
-    }
-    return KM_ERROR_OK;
+    bundle.TruncateChain(0);
+    return bundle.Store(key_slot);
 }
 
 keymaster_error_t SetProductId(const uint8_t product_id[kProductIdSize]) {
@@ -452,15 +948,24 @@ keymaster_error_t DeleteProductId() {
     return KM_ERROR_OK;
 }
 
+// Removes the bundle and any legacy files of |key_slot| without parsing them,
+// so a corrupt slot can still be wiped.
 static keymaster_error_t DeleteAttestationData(AttestationKeySlot key_slot) {
-    if (DeleteKey(key_slot) != KM_ERROR_OK ||
-        DeleteCertChain(key_slot) != KM_ERROR_OK) {
+    UniquePtr<char[]> bundle_file(new char[kStorageIdLengthMax]);
+    BundleFileName(key_slot, bundle_file.get());
+    InvalidateCachedBundle(key_slot);
+    if (!SecureStorageDeleteFile(bundle_file.get()) ||
+        !DeleteLegacyFiles(key_slot)) {
         return KM_ERROR_UNKNOWN_ERROR;
     }
     return KM_ERROR_OK;
 }
 
 keymaster_error_t DeleteAllAttestationData() {
+    StorageTransaction transaction;
+    if (transaction.error() != KM_ERROR_OK) {
+        return transaction.error();
+    }
     if (DeleteAttestationData(AttestationKeySlot::kRsa) != KM_ERROR_OK ||
         DeleteAttestationData(AttestationKeySlot::kEcdsa) != KM_ERROR_OK ||
         DeleteAttestationData(AttestationKeySlot::kEddsa) != KM_ERROR_OK ||
@@ -472,7 +977,7 @@ keymaster_error_t DeleteAllAttestationData() {
         DeleteAttestationData(AttestationKeySlot::kSomEpid) != KM_ERROR_OK) {
         return KM_ERROR_UNKNOWN_ERROR;
     }
-    return KM_ERROR_OK;
+    return transaction.Commit();
 }
 
 }  // namespace keymaster
@@ -52,7 +52,10 @@ static const size_t kProductIdSize = 16;
 
 /**
  * These functions implement key and certificate chain storage on top Trusty's
- * secure storage service. All data is stored in the RPMB filesystem.
+ * secure storage service. All data is stored in the RPMB filesystem, with the
+ * key and certificate chain of each slot kept together in one bundle file.
+ * Slots written in the older one-file-per-object layout are moved into a
+ * bundle the first time they are accessed.
  */
 
 /**
@@ -96,7 +99,9 @@ keymaster_error_t ReadCertChainFromStorage(AttestationKeySlot key_slot,
 /*
  * Writes the new length of the stored |key_slot| attestation certificate chain.
  * If less than the existing certificate chain length, the chain is truncated.
- * Input cannot be larger than the current certificate chain length + 1.
+ * Input cannot be larger than the current certificate chain length + 1. A new
+ * last certificate is empty until written with WriteCertToStorage, and
+ * ReadCertChainFromStorage fails until then.
  */
 keymaster_error_t WriteCertChainLength(AttestationKeySlot key_slot,
                                        uint32_t cert_chain_length);
@@ -151,6 +156,44 @@ keymaster_error_t DeleteCertChain(AttestationKeySlot key_slot);
  */
 keymaster_error_t DeleteAllAttestationData();
 
+/**
+ * Starts a storage transaction. Until it is committed or aborted, every write
+ * and delete made through the functions above is staged rather than committed
+ * to RPMB, and reads see the staged data. Transactions do not nest.
+ */
+keymaster_error_t BeginStorageTransaction();
+
+/**
+ * Commits everything staged since BeginStorageTransaction() in a single RPMB
+ * commit.
+ */
+keymaster_error_t CommitStorageTransaction();
+
+/**
+ * Discards everything staged since BeginStorageTransaction().
+ */
+void AbortStorageTransaction();
+
+/**
+ * RAII wrapper for a storage transaction. The transaction is aborted on
+ * destruction unless Commit() was called.
+ */
+class StorageTransaction {
+public:
+    StorageTransaction();
+    ~StorageTransaction();
+
+    keymaster_error_t error() const { return error_; }
+    keymaster_error_t Commit();
+
+private:
+    keymaster_error_t error_;
+    bool done_ = false;
+
+    StorageTransaction(const StorageTransaction&) = delete;
+    void operator=(const StorageTransaction&) = delete;
+};
+
 }  // namespace keymaster
 
 #endif  // TRUSTY_APP_KEYMASTER_SECURE_STORAGE_H_
@@ -71,6 +71,7 @@ using keymaster::KeymasterKeyBlob;
 using keymaster::kProductIdSize;
 using keymaster::ReadProductId;
 using keymaster::SetProductId;
+using keymaster::StorageTransaction;
 
 uint8_t* NewRandBuf(uint32_t size) {
     UniquePtr<uint8_t[]> buf(new uint8_t[size]);
@@ -111,6 +112,149 @@ test_abort:
     TEST_END;
 }
 
+void TestStorageTransaction(AttestationKeySlot key_slot) {
+    keymaster_error_t error = KM_ERROR_OK;
+    UniquePtr<uint8_t[]> write_key;
+    UniquePtr<uint8_t[]> write_cert;
+    uint32_t cert_chain_length;
+    bool key_exists = true;
+
+    TEST_BEGIN(__func__);
+
+    write_key.reset(NewRandBuf(DATA_SIZE));
+    ASSERT_NE(nullptr, write_key.get());
+    write_cert.reset(NewRandBuf(DATA_SIZE));
+    ASSERT_NE(nullptr, write_cert.get());
+
+    // Aborted transaction leaves nothing behind
+    {
+        StorageTransaction transaction;
+        ASSERT_EQ(KM_ERROR_OK, transaction.error());
+        error = WriteKeyToStorage(key_slot, write_key.get(), DATA_SIZE);
+        ASSERT_EQ(KM_ERROR_OK, error);
+        error = WriteCertToStorage(key_slot, write_cert.get(), DATA_SIZE, 0);
+        ASSERT_EQ(KM_ERROR_OK, error);
+
+        // Staged data is visible inside the transaction
+        error = ReadCertChainLength(key_slot, &cert_chain_length);
+        ASSERT_EQ(KM_ERROR_OK, error);
+        ASSERT_EQ(1, cert_chain_length);
+    }
+    error = AttestationKeyExists(key_slot, &key_exists);
+    ASSERT_EQ(KM_ERROR_OK, error);
+    ASSERT_EQ(false, key_exists);
+    error = ReadCertChainLength(key_slot, &cert_chain_length);
+    ASSERT_EQ(KM_ERROR_OK, error);
+    ASSERT_EQ(0, cert_chain_length);
+
+    // Committed transaction lands everything
+    {
+        StorageTransaction transaction;
+        ASSERT_EQ(KM_ERROR_OK, transaction.error());
+        error = WriteKeyToStorage(key_slot, write_key.get(), DATA_SIZE);
+        ASSERT_EQ(KM_ERROR_OK, error);
+        error = WriteCertToStorage(key_slot, write_cert.get(), DATA_SIZE, 0);
+        ASSERT_EQ(KM_ERROR_OK, error);
+        ASSERT_EQ(KM_ERROR_OK, transaction.Commit());
+    }
+    error = AttestationKeyExists(key_slot, &key_exists);
+    ASSERT_EQ(KM_ERROR_OK, error);
+    ASSERT_EQ(true, key_exists);
+    error = ReadCertChainLength(key_slot, &cert_chain_length);
+    ASSERT_EQ(KM_ERROR_OK, error);
+    ASSERT_EQ(1, cert_chain_length);
+
+test_abort:
+    TEST_END;
+}
+
+bool WriteLegacyFile(storage_session_t session,
+                     const char* name,
+                     const void* data,
+                     uint32_t size) {
+    file_handle_t handle;
+    int rc = storage_open_file(session, &handle, const_cast<char*>(name),
+                               STORAGE_FILE_OPEN_CREATE |
+                                       STORAGE_FILE_OPEN_TRUNCATE,
+                               0);
+    if (rc < 0) {
+        return false;
+    }
+    rc = storage_write(handle, 0, data, size, STORAGE_OP_COMPLETE);
+    storage_close_file(handle);
+    return rc == static_cast<int>(size);
+}
+
+bool LegacyFileExists(storage_session_t session, const char* name) {
+    file_handle_t handle;
+    if (storage_open_file(session, &handle, const_cast<char*>(name), 0, 0) <
+        0) {
+        return false;
+    }
+    storage_close_file(handle);
+    return true;
+}
+
+void TestLegacyMigration() {
+    keymaster_error_t error = KM_ERROR_OK;
+    storage_session_t session = 0;
+    int rc = -1;
+    UniquePtr<uint8_t[]> write_key;
+    UniquePtr<uint8_t[]> write_cert[2];
+    uint32_t legacy_length = 2;
+    KeymasterKeyBlob key_blob;
+    UniquePtr<keymaster_cert_chain_t, CertificateChainDelete> chain;
+
+    TEST_BEGIN(__func__);
+
+    rc = storage_open_session(&session, STORAGE_CLIENT_TP_PORT);
+    ASSERT_EQ(0, rc);
+
+    // Lay out the ec slot the way older builds stored it
+    write_key.reset(NewRandBuf(DATA_SIZE));
+    ASSERT_NE(nullptr, write_key.get());
+    ASSERT_EQ(true, WriteLegacyFile(session, "AttestKey..ec", write_key.get(),
+                                    DATA_SIZE));
+    ASSERT_EQ(true, WriteLegacyFile(session, "AttestKey..ec.length",
+                                    &legacy_length, sizeof(legacy_length)));
+    for (unsigned int i = 0; i < 2; ++i) {
+        char name[32];
+        snprintf(name, sizeof(name), "AttestCert..ec.%u", i);
+        write_cert[i].reset(NewRandBuf(DATA_SIZE));
+        ASSERT_NE(nullptr, write_cert[i].get());
+        ASSERT_EQ(true, WriteLegacyFile(session, name, write_cert[i].get(),
+                                        DATA_SIZE));
+    }
+
+    key_blob = ReadKeyFromStorage(AttestationKeySlot::kEcdsa, &error);
+    ASSERT_EQ(KM_ERROR_OK, error);
+    ASSERT_EQ(DATA_SIZE, key_blob.key_material_size);
+    ASSERT_EQ(0, memcmp(write_key.get(), key_blob.key_material, DATA_SIZE));
+
+    chain.reset(new keymaster_cert_chain_t);
+    ASSERT_NE(nullptr, chain.get());
+    error = ReadCertChainFromStorage(AttestationKeySlot::kEcdsa, chain.get());
+    ASSERT_EQ(KM_ERROR_OK, error);
+    ASSERT_EQ(2, chain.get()->entry_count);
+    for (unsigned int i = 0; i < 2; ++i) {
+        ASSERT_EQ(DATA_SIZE, chain.get()->entries[i].data_length);
+        ASSERT_EQ(0, memcmp(write_cert[i].get(), chain.get()->entries[i].data,
+                            DATA_SIZE));
+    }
+
+    // The legacy files are gone once the slot has been migrated
+    ASSERT_EQ(false, LegacyFileExists(session, "AttestKey..ec"));
+    ASSERT_EQ(false, LegacyFileExists(session, "AttestKey..ec.length"));
+    ASSERT_EQ(false, LegacyFileExists(session, "AttestCert..ec.0"));
+    ASSERT_EQ(false, LegacyFileExists(session, "AttestCert..ec.1"));
+
+test_abort:
+    if (rc == 0) {
+        storage_close_session(session);
+    }
+    TEST_END;
+}
+
 void TestCertChainStorage(AttestationKeySlot key_slot, bool chain_exists) {
     keymaster_error_t error = KM_ERROR_OK;
     UniquePtr<uint8_t[]> write_cert[CHAIN_LENGTH];
@@ -276,6 +420,12 @@ int main(void) {
 
     DeleteAttestationData();
 
+    TestStorageTransaction(AttestationKeySlot::kEcdsa);
+    DeleteAttestationData();
+
+    TestLegacyMigration();
+    DeleteAttestationData();
+
     TestKeyStorage(AttestationKeySlot::kRsa);
     TestKeyStorage(AttestationKeySlot::kEcdsa);
     TestCertChainStorage(AttestationKeySlot::kRsa, false);
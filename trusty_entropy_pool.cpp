@@ -0,0 +1,73 @@
+/*
+ * Copyright 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "trusty_entropy_pool.h"
+
+#include <string.h>
+
+#include <lib/rng/trusty_rng.h>
+
+#include <keymaster/android_keymaster_utils.h>
+#include <keymaster/logger.h>
+
+namespace keymaster {
+
+namespace {
+
+/* Bytes read from the hardware RNG per refill */
+const size_t kEntropyPoolChunk = 64;
+
+}  // anonymous namespace
+
+EntropyPool::~EntropyPool() {
+    memset_s(bytes_, 0, sizeof(bytes_));
+}
+
+bool EntropyPool::Take(uint8_t* buf, size_t size) {
+    refill_failed_ = false;
+
+    size_t from_pool = size < available_ ? size : available_;
+    uint8_t* src = bytes_ + available_ - from_pool;
+    memcpy(buf, src, from_pool);
+    memset_s(src, 0, from_pool);
+    available_ -= from_pool;
+
+    if (from_pool < size &&
+        trusty_rng_hw_rand(buf + from_pool, size - from_pool) != 0) {
+        LOG_E("Failed to get bytes from HW RNG", 0);
+        return false;
+    }
+    return true;
+}
+
+bool EntropyPool::NeedsRefill() const {
+    return !refill_failed_ && available_ < sizeof(bytes_);
+}
+
+bool EntropyPool::RefillOne() {
+    size_t size = sizeof(bytes_) - available_;
+    if (size > kEntropyPoolChunk)
+        size = kEntropyPoolChunk;
+    if (trusty_rng_hw_rand(bytes_ + available_, size) != 0) {
+        LOG_E("Failed to get bytes from HW RNG", 0);
+        refill_failed_ = true;
+        return false;
+    }
+    available_ += size;
+    return true;
+}
+
+}  // namespace keymaster
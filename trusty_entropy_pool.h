@@ -0,0 +1,89 @@
+/*
+ * Copyright 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef TRUSTY_APP_KEYMASTER_TRUSTY_ENTROPY_POOL_H_
+#define TRUSTY_APP_KEYMASTER_TRUSTY_ENTROPY_POOL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Bytes of hardware RNG output kept ready for reseeding the Trusty RNG. Each
+ * reseed uses 64 bytes, so the default covers four reseeds without touching
+ * the hardware RNG.
+ */
+#ifndef KEYMASTER_ENTROPY_POOL_BYTES
+#define KEYMASTER_ENTROPY_POOL_BYTES 256
+#endif
+
+/*
+ * The Trusty RNG is reseeded once this many bytes have been drawn from it
+ * through GenerateRandom, or this long after the previous reseed, whichever
+ * comes first.
+ */
+#ifndef KEYMASTER_RNG_RESEED_BYTES
+#define KEYMASTER_RNG_RESEED_BYTES 2048
+#endif
+
+#ifndef KEYMASTER_RNG_RESEED_PERIOD_MS
+#define KEYMASTER_RNG_RESEED_PERIOD_MS (60 * 1000)
+#endif
+
+namespace keymaster {
+
+/*
+ * Buffer of hardware RNG output. It is topped up a chunk at a time while the
+ * TA is idle, so that reseeding the Trusty RNG on the request path does not
+ * have to wait for the hardware RNG. Bytes are handed out once and wiped as
+ * they leave the buffer.
+ */
+class EntropyPool {
+public:
+    EntropyPool() {}
+    ~EntropyPool();
+
+    /*
+     * Copies |size| bytes of hardware entropy into |buf|, taken from the pool
+     * as far as it goes and read from the hardware RNG for the rest. Returns
+     * false if the hardware RNG fails.
+     */
+    bool Take(uint8_t* buf, size_t size);
+
+    /*
+     * True if the pool has room for more entropy. After a hardware RNG
+     * failure this stays false until the next Take.
+     */
+    bool NeedsRefill() const;
+
+    /*
+     * Reads one chunk from the hardware RNG into the pool.
+     */
+    bool RefillOne();
+
+    size_t available() const { return available_; }
+
+private:
+    uint8_t bytes_[KEYMASTER_ENTROPY_POOL_BYTES];
+    size_t available_ = 0;
+    bool refill_failed_ = false;
+
+    EntropyPool(const EntropyPool&) = delete;
+    void operator=(const EntropyPool&) = delete;
+};
+
+}  // namespace keymaster
+
+#endif  // TRUSTY_APP_KEYMASTER_TRUSTY_ENTROPY_POOL_H_
@@ -0,0 +1,177 @@
+/*
+ * Copyright 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "trusty_key_cache.h"
+
+#include <string.h>
+
+#include <openssl/sha.h>
+
+#include <keymaster/logger.h>
+
+namespace keymaster {
+
+namespace {
+
+void DigestBytes(SHA256_CTX* ctx, const uint8_t* data, size_t size) {
+    uint32_t size32 = size;
+    SHA256_Update(ctx, &size32, sizeof(size32));
+    if (size)
+        SHA256_Update(ctx, data, size);
+}
+
+void DigestTag(SHA256_CTX* ctx,
+               const AuthorizationSet& params,
+               keymaster_tag_t tag) {
+    int index = params.find(tag);
+    uint8_t present = index != -1;
+    SHA256_Update(ctx, &present, sizeof(present));
+    if (present)
+        DigestBytes(ctx, params[index].blob.data,
+                    params[index].blob.data_length);
+}
+
+bool CopyAuthorizations(const AuthorizationSet& src, AuthorizationSet* dst) {
+    return dst->Reinitialize(src) && dst->is_valid() == AuthorizationSet::OK;
+}
+
+}  // anonymous namespace
+
+KeyBlobCache::KeyBlobCache(size_t max_bytes) : max_bytes_(max_bytes) {}
+
+KeyBlobCache::~KeyBlobCache() {
+    Clear();
+}
+
+bool KeyBlobCache::ComputeDigest(const KeymasterKeyBlob& blob,
+                                 const AuthorizationSet& additional_params,
+                                 uint8_t digest[kKeyCacheDigestSize]) {
+    SHA256_CTX ctx;
+    if (!SHA256_Init(&ctx))
+        return false;
+    DigestBytes(&ctx, blob.key_material, blob.key_material_size);
+    DigestTag(&ctx, additional_params, KM_TAG_APPLICATION_ID);
+    DigestTag(&ctx, additional_params, KM_TAG_APPLICATION_DATA);
+    return SHA256_Final(digest, &ctx);
+}
+
+bool KeyBlobCache::Lookup(const uint8_t digest[kKeyCacheDigestSize],
+                          KeymasterKeyBlob* key_material,
+                          AuthorizationSet* hw_enforced,
+                          AuthorizationSet* sw_enforced) {
+    Entry* entry;
+    for (entry = head_; entry; entry = entry->next) {
+        if (memcmp(entry->digest, digest, kKeyCacheDigestSize) == 0)
+            break;
+    }
+    if (!entry) {
+        misses_++;
+        return false;
+    }
+
+    size_t size = entry->key_material.key_material_size;
+    if (!key_material->Reset(size) ||
+        !CopyAuthorizations(entry->hw_enforced, hw_enforced) ||
+        !CopyAuthorizations(entry->sw_enforced, sw_enforced)) {
+        misses_++;
+        return false;
+    }
+    memcpy(key_material->writable_data(), entry->key_material.key_material,
+           size);
+
+    if (entry != head_) {
+        Unlink(entry);
+        PushFront(entry);
+    }
+    hits_++;
+    return true;
+}
+
+void KeyBlobCache::Insert(const uint8_t digest[kKeyCacheDigestSize],
+                          const KeymasterKeyBlob& key_material,
+                          const AuthorizationSet& hw_enforced,
+                          const AuthorizationSet& sw_enforced) {
+    size_t bytes = sizeof(Entry) + key_material.key_material_size +
+                   hw_enforced.SerializedSize() + sw_enforced.SerializedSize();
+    if (bytes > max_bytes_)
+        return;
+
+    for (Entry* entry = head_; entry; entry = entry->next) {
+        if (memcmp(entry->digest, digest, kKeyCacheDigestSize) == 0)
+            return;
+    }
+
+    while (tail_ && bytes_used_ + bytes > max_bytes_)
+        Evict(tail_);
+
+    UniquePtr<Entry> entry(new Entry);
+    if (!entry.get())
+        return;
+    memcpy(entry->digest, digest, kKeyCacheDigestSize);
+    if (!entry->key_material.Reset(key_material.key_material_size) ||
+        !CopyAuthorizations(hw_enforced, &entry->hw_enforced) ||
+        !CopyAuthorizations(sw_enforced, &entry->sw_enforced)) {
+        LOG_D("Not caching key: out of memory", 0);
+        return;
+    }
+    memcpy(entry->key_material.writable_data(), key_material.key_material,
+           key_material.key_material_size);
+    entry->bytes = bytes;
+
+    bytes_used_ += bytes;
+    PushFront(entry.release());
+}
+
+void KeyBlobCache::Clear() {
+    while (head_) {
+        Entry* entry = head_;
+        Unlink(entry);
+        delete entry;
+    }
+    bytes_used_ = 0;
+}
+
+void KeyBlobCache::Unlink(Entry* entry) {
+    if (entry->prev)
+        entry->prev->next = entry->next;
+    else
+        head_ = entry->next;
+    if (entry->next)
+        entry->next->prev = entry->prev;
+    else
+        tail_ = entry->prev;
+    entry->prev = entry->next = nullptr;
+}
+
+void KeyBlobCache::PushFront(Entry* entry) {
+    entry->prev = nullptr;
+    entry->next = head_;
+    if (head_)
+        head_->prev = entry;
+    head_ = entry;
+    if (!tail_)
+        tail_ = entry;
+}
+
+/* KeymasterKeyBlob wipes the key material when the entry is destroyed. */
+void KeyBlobCache::Evict(Entry* entry) {
+    Unlink(entry);
+    bytes_used_ -= entry->bytes;
+    evictions_++;
+    delete entry;
+}
+
+}  // namespace keymaster
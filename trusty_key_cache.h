@@ -0,0 +1,118 @@
+/*
+ * Copyright 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef TRUSTY_APP_KEYMASTER_TRUSTY_KEY_CACHE_H_
+#define TRUSTY_APP_KEYMASTER_TRUSTY_KEY_CACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <keymaster/android_keymaster_utils.h>
+#include <keymaster/authorization_set.h>
+
+/*
+ * Default byte budget of the parsed key cache. The TA heap is 24 pages
+ * (manifest.c) and BoringSSL needs most of it for RSA operations, so the
+ * cache is kept to two pages unless the build overrides it.
+ */
+#ifndef KEYMASTER_KEY_CACHE_BYTES
+#define KEYMASTER_KEY_CACHE_BYTES (2 * 4096)
+#endif
+
+namespace keymaster {
+
+static const size_t kKeyCacheDigestSize = 32;
+
+/*
+ * Bounded LRU of decrypted key blobs. Entries are indexed by a SHA-256 digest
+ * of the serialized blob and the APPLICATION_ID/APPLICATION_DATA values that
+ * were mixed into its encryption, and hold the plaintext key material with
+ * the hardware and software enforced authorization lists. Lookups return
+ * copies, since Key objects built from them are handed off to operations.
+ */
+class KeyBlobCache {
+public:
+    explicit KeyBlobCache(size_t max_bytes = KEYMASTER_KEY_CACHE_BYTES);
+    ~KeyBlobCache();
+
+    /*
+     * Computes the cache index for |blob| loaded with |additional_params|.
+     */
+    static bool ComputeDigest(const KeymasterKeyBlob& blob,
+                              const AuthorizationSet& additional_params,
+                              uint8_t digest[kKeyCacheDigestSize]);
+
+    /*
+     * Copies the entry for |digest| into the output parameters and marks it
+     * most recently used. Returns false on a miss or allocation failure.
+     */
+    bool Lookup(const uint8_t digest[kKeyCacheDigestSize],
+                KeymasterKeyBlob* key_material,
+                AuthorizationSet* hw_enforced,
+                AuthorizationSet* sw_enforced);
+
+    /*
+     * Adds a copy of the decrypted key under |digest|, evicting least
+     * recently used entries until it fits the byte budget. Keys larger than
+     * the whole budget are not cached.
+     */
+    void Insert(const uint8_t digest[kKeyCacheDigestSize],
+                const KeymasterKeyBlob& key_material,
+                const AuthorizationSet& hw_enforced,
+                const AuthorizationSet& sw_enforced);
+
+    /*
+     * Drops (and wipes) every entry.
+     */
+    void Clear();
+
+    uint32_t hits() const { return hits_; }
+    uint32_t misses() const { return misses_; }
+    uint32_t evictions() const { return evictions_; }
+    size_t bytes_used() const { return bytes_used_; }
+    size_t max_bytes() const { return max_bytes_; }
+
+private:
+    struct Entry {
+        uint8_t digest[kKeyCacheDigestSize];
+        KeymasterKeyBlob key_material;
+        AuthorizationSet hw_enforced;
+        AuthorizationSet sw_enforced;
+        size_t bytes;
+        Entry* prev;
+        Entry* next;
+    };
+
+    void Unlink(Entry* entry);
+    void PushFront(Entry* entry);
+    void Evict(Entry* entry);
+
+    /* Most recently used entry first. */
+    Entry* head_ = nullptr;
+    Entry* tail_ = nullptr;
+    size_t max_bytes_;
+    size_t bytes_used_ = 0;
+    uint32_t hits_ = 0;
+    uint32_t misses_ = 0;
+    uint32_t evictions_ = 0;
+
+    KeyBlobCache(const KeyBlobCache&) = delete;
+    void operator=(const KeyBlobCache&) = delete;
+};
+
+}  // namespace keymaster
+
+#endif  // TRUSTY_APP_KEYMASTER_TRUSTY_KEY_CACHE_H_
@@ -0,0 +1,330 @@
+/*
+ * Copyright 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "trusty_key_pool.h"
+
+#include <string.h>
+
+#include <openssl/bn.h>
+#include <openssl/ec_key.h>
+#include <openssl/evp.h>
+#include <openssl/nid.h>
+#include <openssl/rsa.h>
+
+#include <keymaster/km_openssl/openssl_err.h>
+#include <keymaster/km_openssl/openssl_utils.h>
+#include <keymaster/logger.h>
+
+namespace keymaster {
+
+namespace {
+
+struct KeyPoolSpec {
+    keymaster_algorithm_t algorithm;
+    uint32_t key_size;
+    uint64_t public_exponent;
+    size_t capacity;
+};
+
+const KeyPoolSpec kKeyPoolSpecs[] = {
+        {KM_ALGORITHM_RSA, 2048, 65537, KEYMASTER_KEY_POOL_RSA_2048_KEYS},
+        {KM_ALGORITHM_EC, 256, 0, KEYMASTER_KEY_POOL_EC_256_KEYS},
+};
+
+static_assert(sizeof(kKeyPoolSpecs) / sizeof(kKeyPoolSpecs[0]) == kNumKeyPools,
+              "kNumKeyPools does not match kKeyPoolSpecs");
+
+int FindPool(keymaster_algorithm_t algorithm,
+             uint32_t key_size,
+             uint64_t public_exponent) {
+    for (size_t i = 0; i < kNumKeyPools; i++) {
+        const KeyPoolSpec& spec = kKeyPoolSpecs[i];
+        if (spec.algorithm == algorithm && spec.key_size == key_size &&
+            (algorithm != KM_ALGORITHM_RSA ||
+             spec.public_exponent == public_exponent)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+bool EcCurveToKeySize(keymaster_ec_curve_t curve, uint32_t* key_size) {
+    switch (curve) {
+    case KM_EC_CURVE_P_224:
+        *key_size = 224;
+        return true;
+    case KM_EC_CURVE_P_256:
+        *key_size = 256;
+        return true;
+    case KM_EC_CURVE_P_384:
+        *key_size = 384;
+        return true;
+    case KM_EC_CURVE_P_521:
+        *key_size = 521;
+        return true;
+    default:
+        return false;
+    }
+}
+
+bool EcKeySizeToCurve(uint32_t key_size, keymaster_ec_curve_t* curve) {
+    switch (key_size) {
+    case 224:
+        *curve = KM_EC_CURVE_P_224;
+        return true;
+    case 256:
+        *curve = KM_EC_CURVE_P_256;
+        return true;
+    case 384:
+        *curve = KM_EC_CURVE_P_384;
+        return true;
+    case 521:
+        *curve = KM_EC_CURVE_P_521;
+        return true;
+    default:
+        return false;
+    }
+}
+
+int EcKeySizeToNid(uint32_t key_size) {
+    switch (key_size) {
+    case 224:
+        return NID_secp224r1;
+    case 256:
+        return NID_X9_62_prime256v1;
+    case 384:
+        return NID_secp384r1;
+    case 521:
+        return NID_secp521r1;
+    default:
+        return NID_undef;
+    }
+}
+
+keymaster_error_t GenerateRsaKeyMaterial(const KeyPoolSpec& spec,
+                                         KeymasterKeyBlob* key_material) {
+    UniquePtr<BIGNUM, BIGNUM_Delete> exponent(BN_new());
+    UniquePtr<RSA, RSA_Delete> rsa_key(RSA_new());
+    UniquePtr<EVP_PKEY, EVP_PKEY_Delete> pkey(EVP_PKEY_new());
+    if (!exponent.get() || !rsa_key.get() || !pkey.get())
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+
+    if (!BN_set_word(exponent.get(), spec.public_exponent) ||
+        !RSA_generate_key_ex(rsa_key.get(), spec.key_size, exponent.get(),
+                             nullptr /* callback */))
+        return TranslateLastOpenSslError();
+
+    if (!EVP_PKEY_set1_RSA(pkey.get(), rsa_key.get()))
+        return TranslateLastOpenSslError();
+
+    return EvpKeyToKeyMaterial(pkey.get(), key_material);
+}
+
+keymaster_error_t GenerateEcKeyMaterial(const KeyPoolSpec& spec,
+                                        KeymasterKeyBlob* key_material) {
+    int nid = EcKeySizeToNid(spec.key_size);
+    if (nid == NID_undef)
+        return KM_ERROR_UNSUPPORTED_KEY_SIZE;
+
+    UniquePtr<EC_KEY, EC_KEY_Delete> ec_key(EC_KEY_new_by_curve_name(nid));
+    UniquePtr<EVP_PKEY, EVP_PKEY_Delete> pkey(EVP_PKEY_new());
+    if (!ec_key.get() || !pkey.get())
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+
+    if (!EC_KEY_generate_key(ec_key.get()) ||
+        !EVP_PKEY_set1_EC_KEY(pkey.get(), ec_key.get()))
+        return TranslateLastOpenSslError();
+
+    return EvpKeyToKeyMaterial(pkey.get(), key_material);
+}
+
+}  // anonymous namespace
+
+KeyPool::~KeyPool() {
+    Clear();
+}
+
+bool KeyPool::Take(keymaster_algorithm_t algorithm,
+                   uint32_t key_size,
+                   uint64_t public_exponent,
+                   KeymasterKeyBlob* key_material) {
+    int index = FindPool(algorithm, key_size, public_exponent);
+    if (index == -1)
+        return false;
+    refill_failed_ = false;
+
+    Entry* entry = heads_[index];
+    if (!entry) {
+        misses_++;
+        return false;
+    }
+
+    size_t size = entry->key_material.key_material_size;
+    if (!key_material->Reset(size)) {
+        misses_++;
+        return false;
+    }
+    memcpy(key_material->writable_data(), entry->key_material.key_material,
+           size);
+
+    /* The key is handed out once; KeymasterKeyBlob wipes the pooled copy. */
+    heads_[index] = entry->next;
+    counts_[index]--;
+    delete entry;
+    hits_++;
+    return true;
+}
+
+bool KeyPool::NeedsRefill() const {
+    if (refill_failed_)
+        return false;
+    for (size_t i = 0; i < kNumKeyPools; i++) {
+        if (counts_[i] < kKeyPoolSpecs[i].capacity)
+            return true;
+    }
+    return false;
+}
+
+int KeyPool::NextRefillPool() const {
+    int index = -1;
+    size_t most_missing = 0;
+    for (size_t i = 0; i < kNumKeyPools; i++) {
+        size_t capacity = kKeyPoolSpecs[i].capacity;
+        if (counts_[i] < capacity && capacity - counts_[i] > most_missing) {
+            most_missing = capacity - counts_[i];
+            index = i;
+        }
+    }
+    return index;
+}
+
+bool KeyPool::NextRefillIsSlow() const {
+    int index = NextRefillPool();
+    return index != -1 && kKeyPoolSpecs[index].algorithm == KM_ALGORITHM_RSA;
+}
+
+keymaster_error_t KeyPool::RefillOne() {
+    int index = NextRefillPool();
+    if (index == -1)
+        return KM_ERROR_OK;
+
+    const KeyPoolSpec& spec = kKeyPoolSpecs[index];
+    UniquePtr<Entry> entry(new Entry);
+    if (!entry.get())
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+
+    keymaster_error_t error;
+    if (spec.algorithm == KM_ALGORITHM_RSA)
+        error = GenerateRsaKeyMaterial(spec, &entry->key_material);
+    else
+        error = GenerateEcKeyMaterial(spec, &entry->key_material);
+    if (error != KM_ERROR_OK) {
+        LOG_E("Failed (%d) to generate pooled key", error);
+        refill_failed_ = true;
+        return error;
+    }
+
+    entry->next = heads_[index];
+    heads_[index] = entry.release();
+    counts_[index]++;
+    return KM_ERROR_OK;
+}
+
+void KeyPool::Clear() {
+    for (size_t i = 0; i < kNumKeyPools; i++) {
+        while (heads_[i]) {
+            Entry* entry = heads_[i];
+            heads_[i] = entry->next;
+            delete entry;
+        }
+        counts_[i] = 0;
+    }
+    refill_failed_ = false;
+}
+
+keymaster_error_t PooledRsaKeyFactory::GenerateKey(
+        const AuthorizationSet& key_description,
+        KeymasterKeyBlob* key_blob,
+        AuthorizationSet* hw_enforced,
+        AuthorizationSet* sw_enforced) const {
+    if (!key_blob || !hw_enforced || !sw_enforced)
+        return KM_ERROR_OUTPUT_PARAMETER_NULL;
+
+    /* Requests missing either tag fail in RsaKeyFactory with the usual error */
+    uint32_t key_size;
+    uint64_t public_exponent;
+    KeymasterKeyBlob key_material;
+    if (!key_description.GetTagValue(TAG_KEY_SIZE, &key_size) ||
+        !key_description.GetTagValue(TAG_RSA_PUBLIC_EXPONENT,
+                                     &public_exponent) ||
+        !pool_->Take(KM_ALGORITHM_RSA, key_size, public_exponent,
+                     &key_material)) {
+        return RsaKeyFactory::GenerateKey(key_description, key_blob,
+                                          hw_enforced, sw_enforced);
+    }
+
+    return blob_maker_->CreateKeyBlob(key_description, KM_ORIGIN_GENERATED,
+                                      key_material, key_blob, hw_enforced,
+                                      sw_enforced);
+}
+
+keymaster_error_t PooledEcKeyFactory::GenerateKey(
+        const AuthorizationSet& key_description,
+        KeymasterKeyBlob* key_blob,
+        AuthorizationSet* hw_enforced,
+        AuthorizationSet* sw_enforced) const {
+    if (!key_blob || !hw_enforced || !sw_enforced)
+        return KM_ERROR_OUTPUT_PARAMETER_NULL;
+
+    /*
+     * Resolve the curve the way EcKeyFactory does. Anything it would reject,
+     * including a key size that disagrees with the curve, is left to it.
+     */
+    uint32_t key_size = 0;
+    keymaster_ec_curve_t ec_curve = KM_EC_CURVE_P_256;
+    bool has_key_size = key_description.GetTagValue(TAG_KEY_SIZE, &key_size);
+    bool has_ec_curve = key_description.GetTagValue(TAG_EC_CURVE, &ec_curve);
+    bool resolved;
+    if (has_ec_curve) {
+        uint32_t curve_size = 0;
+        resolved = EcCurveToKeySize(ec_curve, &curve_size) &&
+                   (!has_key_size || key_size == curve_size);
+        key_size = curve_size;
+    } else {
+        resolved = has_key_size && EcKeySizeToCurve(key_size, &ec_curve);
+    }
+
+    KeymasterKeyBlob key_material;
+    if (!resolved ||
+        !pool_->Take(KM_ALGORITHM_EC, key_size, 0, &key_material)) {
+        return EcKeyFactory::GenerateKey(key_description, key_blob,
+                                         hw_enforced, sw_enforced);
+    }
+
+    AuthorizationSet authorizations(key_description);
+    if (!has_key_size)
+        authorizations.push_back(TAG_KEY_SIZE, key_size);
+    if (!has_ec_curve)
+        authorizations.push_back(TAG_EC_CURVE, ec_curve);
+    if (authorizations.is_valid() != AuthorizationSet::OK)
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+
+    return blob_maker_->CreateKeyBlob(authorizations, KM_ORIGIN_GENERATED,
+                                      key_material, key_blob, hw_enforced,
+                                      sw_enforced);
+}
+
+}  // namespace keymaster
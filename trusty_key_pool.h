@@ -0,0 +1,155 @@
+/*
+ * Copyright 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef TRUSTY_APP_KEYMASTER_TRUSTY_KEY_POOL_H_
+#define TRUSTY_APP_KEYMASTER_TRUSTY_KEY_POOL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <keymaster/android_keymaster_utils.h>
+#include <keymaster/authorization_set.h>
+#include <keymaster/km_openssl/ec_key_factory.h>
+#include <keymaster/km_openssl/rsa_key_factory.h>
+
+/*
+ * Number of pre-generated keys kept per pool. A 2048-bit RSA private key is
+ * about 1.2KB of PKCS#8 and a P-256 key well under 200 bytes, so the defaults
+ * hold about 2.7KB of the TA heap. Set a count to 0 to disable that pool.
+ */
+#ifndef KEYMASTER_KEY_POOL_RSA_2048_KEYS
+#define KEYMASTER_KEY_POOL_RSA_2048_KEYS 2
+#endif
+
+#ifndef KEYMASTER_KEY_POOL_EC_256_KEYS
+#define KEYMASTER_KEY_POOL_EC_256_KEYS 2
+#endif
+
+namespace keymaster {
+
+/* RSA-2048/F4 and EC P-256 */
+static const size_t kNumKeyPools = 2;
+
+/*
+ * Pre-generated asymmetric key material, filled one key at a time while the
+ * TA is idle so that GenerateKey for the common key shapes does not have to
+ * wait for RSA prime generation. Keys are held as unwrapped PKCS#8 in TA
+ * memory only; they are wrapped into a key blob when taken, and wiped when
+ * taken, cleared or destroyed.
+ */
+class KeyPool {
+public:
+    KeyPool() {}
+    ~KeyPool();
+
+    /*
+     * Hands out a pooled key of the given shape in |key_material| and drops
+     * it from the pool. The public exponent is ignored for EC keys. Returns
+     * false if none is available.
+     */
+    bool Take(keymaster_algorithm_t algorithm,
+              uint32_t key_size,
+              uint64_t public_exponent,
+              KeymasterKeyBlob* key_material);
+
+    /*
+     * True if some pool is below its capacity. After a failed refill this
+     * stays false until the next Take or Clear, so that an allocation failure
+     * does not turn every idle turn into another attempt.
+     */
+    bool NeedsRefill() const;
+
+    /*
+     * True if the next RefillOne would generate an RSA key, which takes far
+     * longer than the other kinds.
+     */
+    bool NextRefillIsSlow() const;
+
+    /*
+     * Generates one key for the pool furthest below its capacity. This takes
+     * as long as a GenerateKey request for the same key, and cannot be
+     * interrupted.
+     */
+    keymaster_error_t RefillOne();
+
+    /*
+     * Drops (and wipes) every pooled key.
+     */
+    void Clear();
+
+    uint32_t hits() const { return hits_; }
+    uint32_t misses() const { return misses_; }
+
+private:
+    struct Entry {
+        KeymasterKeyBlob key_material;
+        Entry* next;
+    };
+
+    /* Index of the pool furthest below its capacity, or -1 if all are full */
+    int NextRefillPool() const;
+
+    Entry* heads_[kNumKeyPools] = {};
+    size_t counts_[kNumKeyPools] = {};
+    uint32_t hits_ = 0;
+    uint32_t misses_ = 0;
+    bool refill_failed_ = false;
+
+    KeyPool(const KeyPool&) = delete;
+    void operator=(const KeyPool&) = delete;
+};
+
+/*
+ * RsaKeyFactory that takes 2048-bit F4 keys from |pool| when one is
+ * available. Everything else, including LoadKey and the operation factories,
+ * is inherited unchanged.
+ */
+class PooledRsaKeyFactory : public RsaKeyFactory {
+public:
+    PooledRsaKeyFactory(const SoftwareKeyBlobMaker* blob_maker, KeyPool* pool)
+            : RsaKeyFactory(blob_maker), blob_maker_(blob_maker), pool_(pool) {}
+
+    keymaster_error_t GenerateKey(const AuthorizationSet& key_description,
+                                  KeymasterKeyBlob* key_blob,
+                                  AuthorizationSet* hw_enforced,
+                                  AuthorizationSet* sw_enforced) const override;
+
+private:
+    const SoftwareKeyBlobMaker* blob_maker_;
+    KeyPool* pool_;
+};
+
+/*
+ * EcKeyFactory that takes P-256 keys from |pool| when one is available.
+ */
+class PooledEcKeyFactory : public EcKeyFactory {
+public:
+    PooledEcKeyFactory(const SoftwareKeyBlobMaker* blob_maker, KeyPool* pool)
+            : EcKeyFactory(blob_maker), blob_maker_(blob_maker), pool_(pool) {}
+
+    keymaster_error_t GenerateKey(const AuthorizationSet& key_description,
+                                  KeymasterKeyBlob* key_blob,
+                                  AuthorizationSet* hw_enforced,
+                                  AuthorizationSet* sw_enforced) const override;
+
+private:
+    const SoftwareKeyBlobMaker* blob_maker_;
+    KeyPool* pool_;
+};
+
+}  // namespace keymaster
+
+#endif  // TRUSTY_APP_KEYMASTER_TRUSTY_KEY_POOL_H_
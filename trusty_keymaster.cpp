@@ -18,6 +18,10 @@
 
 #include <uapi/err.h>
 
+#include <keymaster/key.h>
+#include <keymaster/keymaster_enforcement.h>
+#include <keymaster/operation.h>
+
 #ifndef DISABLE_ATAP_SUPPORT
 #include <libatap/libatap.h>
 // This assumes EC cert chains do not exceed 1k and other cert chains do not
@@ -29,6 +33,97 @@ const size_t kMaxCaResponseSize = 20000;
 
 namespace keymaster {
 
+namespace {
+
+// Mirrors the OS patchlevel check AndroidKeymaster applies when loading keys.
+keymaster_error_t CheckVersionInfo(const AuthorizationSet& hw_enforced,
+                                   const AuthorizationSet& sw_enforced,
+                                   const KeymasterContext& context) {
+    uint32_t os_version;
+    uint32_t os_patchlevel;
+    context.GetSystemVersion(&os_version, &os_patchlevel);
+
+    uint32_t key_os_patchlevel;
+    if (hw_enforced.GetTagValue(TAG_OS_PATCHLEVEL, &key_os_patchlevel) ||
+        sw_enforced.GetTagValue(TAG_OS_PATCHLEVEL, &key_os_patchlevel)) {
+        if (key_os_patchlevel < os_patchlevel)
+            return KM_ERROR_KEY_REQUIRES_UPGRADE;
+        else if (key_os_patchlevel > os_patchlevel)
+            return KM_ERROR_INVALID_KEY_BLOB;
+    }
+    return KM_ERROR_OK;
+}
+
+bool AppendBuffer(const Buffer& src, Buffer* dst) {
+    size_t size = src.available_read();
+    if (size == 0)
+        return true;
+    return dst->reserve(dst->available_read() + size) &&
+           dst->write(src.peek_read(), size);
+}
+
+/*
+ * Appends the entries of |src| whose tag is not in |dst| yet.
+ */
+bool AddNewTags(const AuthorizationSet& src, AuthorizationSet* dst) {
+    for (const keymaster_key_param_t& param : src) {
+        if (dst->find(param.tag) == -1 && !dst->push_back(param))
+            return false;
+    }
+    return dst->is_valid() == AuthorizationSet::OK;
+}
+
+/*
+ * Feeds the input through Update until the operation stops consuming it, then
+ * hands whatever is left to Finish, as a HAL client would. The response gets
+ * one output parameter per tag: Finish's value if it returned one, else the
+ * last stage before it that did.
+ */
+keymaster_error_t UpdateAndFinish(Operation* operation,
+                                  const OneshotOperationRequest& request,
+                                  const AuthorizationSet& begin_params,
+                                  OneshotOperationResponse* response) {
+    keymaster_error_t error;
+    AuthorizationSet update_params;
+    Buffer input(request.input.peek_read(), request.input.available_read());
+    while (input.available_read()) {
+        AuthorizationSet params;
+        Buffer output;
+        size_t input_consumed = 0;
+        error = operation->Update(request.additional_params, input, &params,
+                                  &output, &input_consumed);
+        if (error != KM_ERROR_OK)
+            return error;
+        // Later Update calls take precedence over earlier ones.
+        if (!AddNewTags(update_params, &params))
+            return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+        update_params = move(params);
+        if (!AppendBuffer(output, &response->output))
+            return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+        if (input_consumed == 0)
+            break;
+        input.advance_read(input_consumed);
+    }
+
+    AuthorizationSet finish_params;
+    Buffer output;
+    error = operation->Finish(request.additional_params, input,
+                              request.signature, &finish_params, &output);
+    if (error != KM_ERROR_OK)
+        return error;
+    if (!AppendBuffer(output, &response->output))
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+
+    response->output_params.Clear();
+    if (!AddNewTags(finish_params, &response->output_params) ||
+        !AddNewTags(update_params, &response->output_params) ||
+        !AddNewTags(begin_params, &response->output_params))
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    return KM_ERROR_OK;
+}
+
+}  // anonymous namespace
+
 long TrustyKeymaster::GetAuthTokenKey(keymaster_key_blob_t* key) {
     keymaster_error_t error = context_->GetAuthTokenKey(key);
     if (error != KM_ERROR_OK)
@@ -127,6 +222,129 @@ void TrustyKeymaster::AppendAttestationCertChain(
             WriteCertToStorage(key_slot, cert, cert_size, cert_chain_length);
 }
 
+void TrustyKeymaster::OneshotOperation(const OneshotOperationRequest& request,
+                                       OneshotOperationResponse* response) {
+    if (response == nullptr)
+        return;
+
+    KeymasterKeyBlob key_blob(request.key_blob.peek_read(),
+                              request.key_blob.available_read());
+    UniquePtr<Key> key;
+    response->error = context_->ParseKeyBlob(
+            key_blob, request.additional_params, &key);
+    if (response->error != KM_ERROR_OK)
+        return;
+    response->error =
+            CheckVersionInfo(key->hw_enforced(), key->sw_enforced(), *context_);
+    if (response->error != KM_ERROR_OK)
+        return;
+
+    // Without an operation handle an auth token can only be checked at begin.
+    response->error = KM_ERROR_INVALID_ARGUMENT;
+    if (key->authorizations().Contains(TAG_USER_SECURE_ID) &&
+        !key->authorizations().Contains(TAG_AUTH_TIMEOUT)) {
+        return;
+    }
+
+    response->error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    if (!response->enforced.Reinitialize(key->hw_enforced()) ||
+        !response->unenforced.Reinitialize(key->sw_enforced())) {
+        return;
+    }
+
+    response->error = KM_ERROR_UNSUPPORTED_PURPOSE;
+    OperationFactory* factory =
+            key->key_factory()->GetOperationFactory(request.purpose);
+    if (!factory)
+        return;
+
+    OperationPtr operation(factory->CreateOperation(
+            move(*key), request.additional_params, &response->error));
+    if (operation.get() == nullptr)
+        return;
+
+    KeymasterEnforcement* policy = context_->enforcement_policy();
+    if (policy) {
+        km_id_t key_id;
+        response->error = KM_ERROR_UNKNOWN_ERROR;
+        if (!policy->CreateKeyId(key_blob, &key_id))
+            return;
+        operation->set_key_id(key_id);
+        response->error = policy->AuthorizeOperation(
+                request.purpose, key_id, operation->authorizations(),
+                request.additional_params, 0 /* op_handle */,
+                true /* is_begin_operation */);
+        if (response->error != KM_ERROR_OK)
+            return;
+    }
+
+    AuthorizationSet begin_params;
+    response->error =
+            operation->Begin(request.additional_params, &begin_params);
+    if (response->error != KM_ERROR_OK)
+        return;
+
+    response->error =
+            UpdateAndFinish(operation.get(), request, begin_params, response);
+    if (response->error != KM_ERROR_OK)
+        operation->Abort();
+}
+
+void TrustyKeymaster::BeginOperation(const BeginOperationRequest& request,
+                                     BeginOperationResponse* response) {
+    if (response == nullptr)
+        return;
+
+    AndroidKeymaster::BeginOperation(request, response);
+    if (response->error != KM_ERROR_OK)
+        return;
+
+    // The key was just loaded, so this is normally a key cache hit.
+    KeymasterKeyBlob key_blob(request.key_blob.key_material,
+                              request.key_blob.key_material_size);
+    UniquePtr<Key> key;
+    keymaster_algorithm_t algorithm;
+    if (context_->ParseKeyBlob(key_blob, request.additional_params, &key) !=
+                KM_ERROR_OK ||
+        !key->authorizations().GetTagValue(TAG_ALGORITHM, &algorithm))
+        return;
+    if (algorithm == KM_ALGORITHM_RSA || algorithm == KM_ALGORITHM_EC) {
+        asymmetric_ops_[next_asymmetric_op_] = response->op_handle;
+        next_asymmetric_op_ =
+                (next_asymmetric_op_ + 1) % kMaxAsymmetricOperations;
+    }
+}
+
+void TrustyKeymaster::FinishOperation(const FinishOperationRequest& request,
+                                      FinishOperationResponse* response) {
+    AndroidKeymaster::FinishOperation(request, response);
+    ForgetOperation(request.op_handle);
+}
+
+void TrustyKeymaster::AbortOperation(const AbortOperationRequest& request,
+                                     AbortOperationResponse* response) {
+    AndroidKeymaster::AbortOperation(request, response);
+    ForgetOperation(request.op_handle);
+}
+
+bool TrustyKeymaster::IsAsymmetricOperation(
+        keymaster_operation_handle_t op_handle) const {
+    if (op_handle == 0)
+        return false;
+    for (keymaster_operation_handle_t handle : asymmetric_ops_) {
+        if (handle == op_handle)
+            return true;
+    }
+    return false;
+}
+
+void TrustyKeymaster::ForgetOperation(keymaster_operation_handle_t op_handle) {
+    for (keymaster_operation_handle_t& handle : asymmetric_ops_) {
+        if (handle == op_handle)
+            handle = 0;
+    }
+}
+
 void TrustyKeymaster::AtapGetCaRequest(const AtapGetCaRequestRequest& request,
                                        AtapGetCaRequestResponse* response) {
     if (response == nullptr)
@@ -95,13 +95,52 @@ public:
     void AtapSetProductId(const AtapSetProductIdRequest& request,
                           AtapSetProductIdResponse* response);
 
+    // OneshotOperation loads a key and runs begin, update and finish on it in
+    // a single call, returning the output together with the key
+    // characteristics. The operation never enters the operation table, so it
+    // does not compete with multi-call operations for slots. Keys that need a
+    // per-operation auth token cannot be used this way, since there is no
+    // operation handle for the token to be bound to.
+    void OneshotOperation(const OneshotOperationRequest& request,
+                          OneshotOperationResponse* response);
+
+    // BeginOperation, FinishOperation and AbortOperation run AndroidKeymaster's
+    // and note which operation handles belong to RSA and EC keys, so that the
+    // IPC layer can tell a Finish that runs a private key operation from one
+    // that only completes a MAC or cipher before it is dispatched.
+    void BeginOperation(const BeginOperationRequest& request,
+                        BeginOperationResponse* response);
+    void FinishOperation(const FinishOperationRequest& request,
+                         FinishOperationResponse* response);
+    void AbortOperation(const AbortOperationRequest& request,
+                        AbortOperationResponse* response);
+
+    // Returns true if |op_handle| is an operation begun with an RSA or EC key.
+    bool IsAsymmetricOperation(keymaster_operation_handle_t op_handle) const;
+
     bool ConfigureCalled() {
         return configure_error_ != KM_ERROR_KEYMASTER_NOT_CONFIGURED;
     }
     keymaster_error_t get_configure_error() { return configure_error_; }
     void set_configure_error(keymaster_error_t err) { configure_error_ = err; }
 
+    KeyPool* key_pool() { return context_->key_pool(); }
+    EntropyPool* entropy_pool() { return context_->entropy_pool(); }
+    bool RngReseedDue() { return context_->RngReseedDue(); }
+    bool ReseedRng() { return context_->ReseedRng(); }
+    bool RngReseedFailed() { return context_->RngReseedFailed(); }
+
 private:
+    void ForgetOperation(keymaster_operation_handle_t op_handle);
+
+    // Handles of recently begun RSA and EC operations. Operations that
+    // AndroidKeymaster drops on an error are never finished or aborted, so
+    // the oldest entry is overwritten when the table is full.
+    static const size_t kMaxAsymmetricOperations = 16;
+    keymaster_operation_handle_t
+            asymmetric_ops_[kMaxAsymmetricOperations] = {};
+    size_t next_asymmetric_op_ = 0;
+
     TrustyKeymasterContext* context_;
     keymaster_error_t configure_error_ = KM_ERROR_KEYMASTER_NOT_CONFIGURED;
     Buffer ca_response_;
@@ -20,6 +20,8 @@
 #include <lib/hwkey/hwkey.h>
 #include <lib/rng/trusty_rng.h>
 
+#include <openssl/sha.h>
+
 #include <keymaster/android_keymaster_utils.h>
 #include <keymaster/km_openssl/ec_key_factory.h>
 #include <keymaster/km_openssl/rsa_key_factory.h>
@@ -41,10 +43,29 @@
 namespace keymaster {
 
 namespace {
-static const int kAesKeySize = 16;
-static const int kCallsBetweenRngReseeds = 32;
 static const int kRngReseedSize = 64;
-static const uint8_t kMasterKeyDerivationData[kAesKeySize] = "KeymasterMaster";
+static const uint8_t kMasterKeyDerivationData[kMasterKeySize] = "KeymasterMaster";
+
+// Key blobs are laid out by SerializeAuthEncryptedBlob, whose parser ignores
+// anything past the software enforced authorizations. Blobs bound to the
+// root-of-trust digest end with this trailer; blobs without it are legacy
+// blobs bound to the individual root-of-trust values. The trailer is not
+// authenticated, but adding or stripping it changes the hidden
+// authorizations, so decryption fails. A legacy blob whose last bytes happen
+// to match the trailer fails to decrypt as a digest-bound blob and is then
+// retried as a legacy one.
+static const uint8_t kBlobTrailerMagic[3] = {'T', 'K', 'B'};
+static const uint8_t kBlobVersionRootOfTrustDigest = 1;
+static const size_t kBlobTrailerSize = sizeof(kBlobTrailerMagic) + 1;
+
+bool IsLegacyKeyBlob(const KeymasterKeyBlob& blob) {
+    if (blob.key_material_size < kBlobTrailerSize)
+        return true;
+    const uint8_t* trailer =
+            blob.key_material + blob.key_material_size - kBlobTrailerSize;
+    return memcmp(trailer, kBlobTrailerMagic, sizeof(kBlobTrailerMagic)) != 0 ||
+           trailer[sizeof(kBlobTrailerMagic)] != kBlobVersionRootOfTrustDigest;
+}
 
 bool UpgradeIntegerTag(keymaster_tag_t tag,
                        uint32_t value,
@@ -75,14 +96,22 @@ bool UpgradeIntegerTag(keymaster_tag_t tag,
 
 TrustyKeymasterContext::TrustyKeymasterContext()
         : enforcement_policy_(this),
-          rng_initialized_(false),
-          calls_since_reseed_(0) {
+          // Due straight away, so the first GenerateRandom or idle turn
+          // seeds the Trusty RNG.
+          bytes_since_reseed_(KEYMASTER_RNG_RESEED_BYTES) {
     LOG_D("Creating TrustyKeymaster", 0);
-    rsa_factory_.reset(new RsaKeyFactory(this));
-    ec_factory_.reset(new EcKeyFactory(this));
+    rsa_factory_.reset(new PooledRsaKeyFactory(this, &key_pool_));
+    ec_factory_.reset(new PooledEcKeyFactory(this, &key_pool_));
     aes_factory_.reset(new AesKeyFactory(this, this));
     hmac_factory_.reset(new HmacKeyFactory(this, this));
     verified_boot_key_.Reinitialize("Unbound", 7);
+    root_of_trust_digest_valid_ = ComputeRootOfTrustDigest(
+            verified_boot_key_, verified_boot_state_, device_locked_,
+            root_of_trust_digest_);
+}
+
+TrustyKeymasterContext::~TrustyKeymasterContext() {
+    InvalidateMasterKey();
 }
 
 const KeyFactory* TrustyKeymasterContext::GetKeyFactory(
@@ -223,6 +252,7 @@ keymaster_error_t TrustyKeymasterContext::SetAuthorizations(
 
 keymaster_error_t TrustyKeymasterContext::BuildHiddenAuthorizations(
         const AuthorizationSet& input_set,
+        bool legacy_root_of_trust,
         AuthorizationSet* hidden) const {
     keymaster_blob_t entry;
     if (input_set.GetTagValue(TAG_APPLICATION_ID, &entry))
@@ -230,10 +260,19 @@ keymaster_error_t TrustyKeymasterContext::BuildHiddenAuthorizations(
     if (input_set.GetTagValue(TAG_APPLICATION_DATA, &entry))
         hidden->push_back(TAG_APPLICATION_DATA, entry.data, entry.data_length);
 
-    // Copy verified boot key, verified boot state, and device lock state to
-    // hidden authorization set for binding to key.
     keymaster_key_param_t root_of_trust;
     root_of_trust.tag = KM_TAG_ROOT_OF_TRUST;
+    if (!legacy_root_of_trust) {
+        if (!root_of_trust_digest_valid_)
+            return KM_ERROR_UNKNOWN_ERROR;
+        root_of_trust.blob.data = root_of_trust_digest_;
+        root_of_trust.blob.data_length = kRootOfTrustDigestSize;
+        hidden->push_back(root_of_trust);
+        return TranslateAuthorizationSetError(hidden->is_valid());
+    }
+
+    // Copy verified boot key, verified boot state, and device lock state to
+    // hidden authorization set for binding to key.
     root_of_trust.blob.data = verified_boot_key_.begin();
     root_of_trust.blob.data_length = verified_boot_key_.buffer_size();
     hidden->push_back(root_of_trust);
@@ -250,6 +289,31 @@ keymaster_error_t TrustyKeymasterContext::BuildHiddenAuthorizations(
     return TranslateAuthorizationSetError(hidden->is_valid());
 }
 
+// The root of trust only changes in SetBootParams, so new blobs are bound to
+// a digest of it rather than to each value.
+// If hashing fails, blobs cannot be created or loaded in the digest-bound
+// form until the next successful call.
+bool TrustyKeymasterContext::ComputeRootOfTrustDigest(
+        const Buffer& verified_boot_key,
+        keymaster_verified_boot_t verified_boot_state,
+        bool device_locked,
+        uint8_t digest[kRootOfTrustDigestSize]) {
+    uint32_t key_size = verified_boot_key.buffer_size();
+    uint32_t state = verified_boot_state;
+    uint8_t locked = device_locked;
+
+    SHA256_CTX ctx;
+    bool ok = SHA256_Init(&ctx) &&
+              SHA256_Update(&ctx, &key_size, sizeof(key_size)) &&
+              SHA256_Update(&ctx, verified_boot_key.begin(), key_size) &&
+              SHA256_Update(&ctx, &state, sizeof(state)) &&
+              SHA256_Update(&ctx, &locked, sizeof(locked)) &&
+              SHA256_Final(digest, &ctx);
+    if (!ok)
+        LOG_E("Failed to hash the root of trust", 0);
+    return ok;
+}
+
 keymaster_error_t TrustyKeymasterContext::CreateAuthEncryptedKeyBlob(
         const AuthorizationSet& key_description,
         const KeymasterKeyBlob& key_material,
@@ -257,8 +321,8 @@ keymaster_error_t TrustyKeymasterContext::CreateAuthEncryptedKeyBlob(
         const AuthorizationSet& sw_enforced,
         KeymasterKeyBlob* blob) const {
     AuthorizationSet hidden;
-    keymaster_error_t error =
-            BuildHiddenAuthorizations(key_description, &hidden);
+    keymaster_error_t error = BuildHiddenAuthorizations(
+            key_description, false /* legacy_root_of_trust */, &hidden);
     if (error != KM_ERROR_OK)
         return error;
 
@@ -283,8 +347,20 @@ keymaster_error_t TrustyKeymasterContext::CreateAuthEncryptedKeyBlob(
     if (error != KM_ERROR_OK)
         return error;
 
-    return SerializeAuthEncryptedBlob(encrypted_key, hw_enforced, sw_enforced,
-                                      nonce, tag, blob);
+    KeymasterKeyBlob serialized;
+    error = SerializeAuthEncryptedBlob(encrypted_key, hw_enforced, sw_enforced,
+                                       nonce, tag, &serialized);
+    if (error != KM_ERROR_OK)
+        return error;
+
+    size_t size = serialized.key_material_size;
+    if (!blob->Reset(size + kBlobTrailerSize))
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    uint8_t* data = blob->writable_data();
+    memcpy(data, serialized.key_material, size);
+    memcpy(data + size, kBlobTrailerMagic, sizeof(kBlobTrailerMagic));
+    data[size + sizeof(kBlobTrailerMagic)] = kBlobVersionRootOfTrustDigest;
+    return KM_ERROR_OK;
 }
 
 keymaster_error_t TrustyKeymasterContext::CreateKeyBlob(
@@ -308,13 +384,13 @@ keymaster_error_t TrustyKeymasterContext::UpgradeKeyBlob(
         const AuthorizationSet& upgrade_params,
         KeymasterKeyBlob* upgraded_key) const {
     UniquePtr<Key> key;
-    keymaster_error_t error =
-            ParseKeyBlob(key_to_upgrade, upgrade_params, &key);
+    // Legacy blobs are rewritten in the current format.
+    bool set_changed;
+    keymaster_error_t error = ParseKeyBlob(key_to_upgrade, upgrade_params,
+                                           &key, &set_changed);
     if (error != KM_ERROR_OK)
         return error;
 
-    bool set_changed = false;
-
     if (boot_os_version_ == 0) {
         // We need to allow "upgrading" OS version to zero, to support upgrading
         // from proper numbered releases to unnumbered development and preview
@@ -354,6 +430,15 @@ keymaster_error_t TrustyKeymasterContext::ParseKeyBlob(
         const KeymasterKeyBlob& blob,
         const AuthorizationSet& additional_params,
         UniquePtr<Key>* key) const {
+    bool legacy_root_of_trust;
+    return ParseKeyBlob(blob, additional_params, key, &legacy_root_of_trust);
+}
+
+keymaster_error_t TrustyKeymasterContext::ParseKeyBlob(
+        const KeymasterKeyBlob& blob,
+        const AuthorizationSet& additional_params,
+        UniquePtr<Key>* key,
+        bool* legacy_root_of_trust) const {
     AuthorizationSet hw_enforced;
     AuthorizationSet sw_enforced;
     KeymasterKeyBlob key_material;
@@ -376,6 +461,17 @@ keymaster_error_t TrustyKeymasterContext::ParseKeyBlob(
     KeymasterKeyBlob encrypted_key_material;
     if (!key)
         return KM_ERROR_UNEXPECTED_NULL_POINTER;
+
+    *legacy_root_of_trust = IsLegacyKeyBlob(blob);
+    uint8_t digest[kKeyCacheDigestSize];
+    bool have_digest =
+            KeyBlobCache::ComputeDigest(blob, additional_params, digest);
+    if (have_digest && key_cache_.Lookup(digest, &key_material, &hw_enforced,
+                                         &sw_enforced)) {
+        error = KM_ERROR_OK;
+        return constructKey();
+    }
+
     error = DeserializeAuthEncryptedBlob(blob, &encrypted_key_material,
                                          &hw_enforced, &sw_enforced, &nonce,
                                          &tag);
@@ -392,12 +488,27 @@ keymaster_error_t TrustyKeymasterContext::ParseKeyBlob(
         return error;
 
     AuthorizationSet hidden;
-    error = BuildHiddenAuthorizations(additional_params, &hidden);
+    error = BuildHiddenAuthorizations(additional_params, *legacy_root_of_trust,
+                                      &hidden);
     if (error != KM_ERROR_OK)
         return error;
 
     error = OcbDecryptKey(hw_enforced, sw_enforced, hidden, master_key,
                           encrypted_key_material, nonce, tag, &key_material);
+    if (error == KM_ERROR_INVALID_KEY_BLOB && !*legacy_root_of_trust) {
+        // Not cached: a cache hit would report it as digest-bound.
+        *legacy_root_of_trust = true;
+        have_digest = false;
+        hidden.Clear();
+        error = BuildHiddenAuthorizations(additional_params, true, &hidden);
+        if (error != KM_ERROR_OK)
+            return error;
+        error = OcbDecryptKey(hw_enforced, sw_enforced, hidden, master_key,
+                              encrypted_key_material, nonce, tag,
+                              &key_material);
+    }
+    if (error == KM_ERROR_OK && have_digest)
+        key_cache_.Insert(digest, key_material, hw_enforced, sw_enforced);
     return constructKey();
 }
 
@@ -405,39 +516,43 @@ keymaster_error_t TrustyKeymasterContext::AddRngEntropy(const uint8_t* buf,
                                                         size_t length) const {
     if (trusty_rng_add_entropy(buf, length) != 0)
         return KM_ERROR_UNKNOWN_ERROR;
+    // Pooled keys were generated without the new entropy.
+    key_pool_.Clear();
     return KM_ERROR_OK;
 }
 
-bool TrustyKeymasterContext::SeedRngIfNeeded() const {
-    if (ShouldReseedRng())
+keymaster_error_t TrustyKeymasterContext::GenerateRandom(uint8_t* buf,
+                                                         size_t length) const {
+    if (RngReseedDue())
         const_cast<TrustyKeymasterContext*>(this)->ReseedRng();
-    return rng_initialized_;
+    bytes_since_reseed_ += length;
+    return SoftwareRandomSource::GenerateRandom(buf, length);
 }
 
-bool TrustyKeymasterContext::ShouldReseedRng() const {
-    if (!rng_initialized_) {
-        LOG_I("RNG not initalized, reseed", 0);
+bool TrustyKeymasterContext::RngReseedDue() const {
+    if (bytes_since_reseed_ >= KEYMASTER_RNG_RESEED_BYTES)
         return true;
-    }
-
-    if (++calls_since_reseed_ % kCallsBetweenRngReseeds == 0) {
-        LOG_I("Periodic reseed", 0);
-        return true;
-    }
-    return false;
+    uint64_t now_ms = enforcement_policy_.get_current_time_ms();
+    return now_ms - last_reseed_ms_ >= KEYMASTER_RNG_RESEED_PERIOD_MS;
 }
 
 bool TrustyKeymasterContext::ReseedRng() {
-    UniquePtr<uint8_t[]> rand_seed(new uint8_t[kRngReseedSize]);
-    memset(rand_seed.get(), 0, kRngReseedSize);
-    if (trusty_rng_hw_rand(rand_seed.get(), kRngReseedSize) != 0) {
-        LOG_E("Failed to get bytes from HW RNG", 0);
-        return false;
+    uint8_t rand_seed[kRngReseedSize];
+    bool reseeded = entropy_pool_.Take(rand_seed, kRngReseedSize);
+    if (reseeded) {
+        LOG_D("Reseeding with %d bytes from HW RNG", kRngReseedSize);
+        reseeded = trusty_rng_add_entropy(rand_seed, kRngReseedSize) == 0;
+        if (!reseeded)
+            LOG_E("Failed to add entropy to the RNG", 0);
     }
-    LOG_I("Reseeding with %d bytes from HW RNG", kRngReseedSize);
-    trusty_rng_add_entropy(rand_seed.get(), kRngReseedSize);
+    memset_s(rand_seed, 0, kRngReseedSize);
 
-    rng_initialized_ = true;
+    // A failed reseed leaves the counters alone, so it stays due.
+    reseed_failed_ = !reseeded;
+    if (!reseeded)
+        return false;
+    bytes_since_reseed_ = 0;
+    last_reseed_ms_ = enforcement_policy_.get_current_time_ms();
     return true;
 }
 
@@ -449,32 +564,53 @@ enum DerivationParams {
 
 keymaster_error_t TrustyKeymasterContext::DeriveMasterKey(
         KeymasterKeyBlob* master_key) const {
+    if (!master_key_initialized_ && !InitializeMasterKey())
+        return KM_ERROR_UNKNOWN_ERROR;
+
+    if (!master_key->Reset(kMasterKeySize)) {
+        LOG_S("Could not allocate memory for master key buffer", 0);
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    }
+    memcpy(master_key->writable_data(), master_key_, kMasterKeySize);
+    return KM_ERROR_OK;
+}
+
+/*
+ * The master key only depends on the device's hardware key, so it is derived
+ * once and kept for the life of the TA rather than paying an hwkey round trip
+ * on every key blob operation.
+ */
+bool TrustyKeymasterContext::InitializeMasterKey() const {
     LOG_D("Deriving master key", 0);
 
     long rc = hwkey_open();
     if (rc < 0) {
-        return KM_ERROR_UNKNOWN_ERROR;
+        LOG_S("Error opening hwkey session: %d", rc);
+        return false;
     }
 
     hwkey_session_t session = (hwkey_session_t)rc;
 
-    if (!master_key->Reset(kAesKeySize)) {
-        LOG_S("Could not allocate memory for master key buffer", 0);
-        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
-    }
-
     uint32_t kdf_version = HWKEY_KDF_VERSION_1;
     rc = hwkey_derive(session, &kdf_version, kMasterKeyDerivationData,
-                      master_key->writable_data(), kAesKeySize);
+                      master_key_, kMasterKeySize);
+    hwkey_close(session);
 
     if (rc < 0) {
         LOG_S("Error deriving master key: %d", rc);
-        return KM_ERROR_UNKNOWN_ERROR;
+        memset_s(master_key_, 0, kMasterKeySize);
+        return false;
     }
 
-    hwkey_close(session);
+    master_key_initialized_ = true;
     LOG_I("Key derivation complete", 0);
-    return KM_ERROR_OK;
+    return true;
+}
+
+void TrustyKeymasterContext::InvalidateMasterKey() {
+    memset_s(master_key_, 0, kMasterKeySize);
+    master_key_initialized_ = false;
+    key_cache_.Clear();
 }
 
 bool TrustyKeymasterContext::InitializeAuthTokenKey() {
@@ -647,19 +783,35 @@ keymaster_error_t TrustyKeymasterContext::SetBootParams(
     if (root_of_trust_set_)
         return KM_ERROR_ROOT_OF_TRUST_ALREADY_SET;
 
-    verified_boot_hash_.Reinitialize(verified_boot_hash);
-    root_of_trust_set_ = true;
-
+    const Buffer* key = &verified_boot_key_;
     if (verified_boot_key.buffer_size()) {
-        verified_boot_key_.Reinitialize(verified_boot_key);
-        verified_boot_state_ = verified_boot_state;
-        device_locked_ = device_locked;
+        key = &verified_boot_key;
     } else {
         // If no verified boot key hash is passed, then verified boot state is
         // considered unverified and unlocked.
-        verified_boot_state_ = KM_VERIFIED_BOOT_UNVERIFIED;
-        device_locked_ = false;
+        verified_boot_state = KM_VERIFIED_BOOT_UNVERIFIED;
+        device_locked = false;
     }
+    // Nothing changes unless the new root of trust can be bound, so a failed
+    // call leaves the TA as it was and may be retried.
+    uint8_t digest[kRootOfTrustDigestSize];
+    if (!ComputeRootOfTrustDigest(*key, verified_boot_state, device_locked,
+                                  digest))
+        return KM_ERROR_UNKNOWN_ERROR;
+
+    verified_boot_hash_.Reinitialize(verified_boot_hash);
+    root_of_trust_set_ = true;
+    // Cached keys were decrypted under the previous root of trust, and pooled
+    // keys generated before the boot state was known.
+    key_cache_.Clear();
+    key_pool_.Clear();
+
+    if (key != &verified_boot_key_)
+        verified_boot_key_.Reinitialize(verified_boot_key);
+    verified_boot_state_ = verified_boot_state;
+    device_locked_ = device_locked;
+    memcpy(root_of_trust_digest_, digest, sizeof(digest));
+    root_of_trust_digest_valid_ = true;
     return KM_ERROR_OK;
 }
 
@@ -26,6 +26,9 @@
 
 #include <keymaster/km_openssl/software_random_source.h>
 
+#include "trusty_entropy_pool.h"
+#include "trusty_key_cache.h"
+#include "trusty_key_pool.h"
 #include "trusty_keymaster_enforcement.h"
 
 namespace keymaster {
@@ -33,7 +36,9 @@ namespace keymaster {
 class KeyFactory;
 
 static const int kAuthTokenKeySize = 32;
+static const int kMasterKeySize = 16;
 static const int kMaxCertChainLength = 3;
+static const int kRootOfTrustDigestSize = 32;
 
 class TrustyKeymasterContext : public KeymasterContext,
                                AttestationRecordContext,
@@ -41,6 +46,7 @@ class TrustyKeymasterContext : public KeymasterContext,
                                SoftwareRandomSource {
 public:
     TrustyKeymasterContext();
+    ~TrustyKeymasterContext();
 
     keymaster_security_level_t GetSecurityLevel() const override {
         return KM_SECURITY_LEVEL_TRUSTED_ENVIRONMENT;
@@ -84,6 +90,14 @@ public:
     keymaster_error_t AddRngEntropy(const uint8_t* buf,
                                     size_t length) const override;
 
+    /*
+     * Draws from the Trusty RNG, reseeding it first if a reseed is due. The
+     * reseed takes its entropy from the pool, so it only waits for the
+     * hardware RNG once the pool has run dry.
+     */
+    keymaster_error_t GenerateRandom(uint8_t* buf,
+                                     size_t length) const override;
+
     keymaster_error_t GetAuthTokenKey(keymaster_key_blob_t* key) const;
 
     KeymasterEnforcement* enforcement_policy() override {
@@ -119,19 +133,71 @@ public:
             keymaster_key_format_t* wrapped_key_format,
             KeymasterKeyBlob* wrapped_key_material) const override;
 
-private:
-    bool SeedRngIfNeeded() const;
-    bool ShouldReseedRng() const;
+    /*
+     * Wipes the cached hwkey-derived master key and every cached decrypted
+     * key. The next key blob operation derives the master key again.
+     */
+    void InvalidateMasterKey();
+
+    const KeyBlobCache& key_cache() const { return key_cache_; }
+
+    /*
+     * Pre-generated RSA and EC key material used by GenerateKey. The IPC
+     * loop refills it while the TA is idle.
+     */
+    KeyPool* key_pool() { return &key_pool_; }
+
+    /*
+     * Hardware RNG output buffered for ReseedRng. The IPC loop tops it up
+     * while the TA is idle.
+     */
+    EntropyPool* entropy_pool() { return &entropy_pool_; }
+
+    /*
+     * True once KEYMASTER_RNG_RESEED_BYTES have been drawn through
+     * GenerateRandom or KEYMASTER_RNG_RESEED_PERIOD_MS have passed since the
+     * last reseed.
+     */
+    bool RngReseedDue() const;
+
+    /*
+     * Mixes hardware entropy from the pool into the Trusty RNG. On failure
+     * the reseed stays due and RngReseedFailed() is true until one succeeds.
+     */
     bool ReseedRng();
+
+    bool RngReseedFailed() const { return reseed_failed_; }
+
+private:
     bool InitializeAuthTokenKey();
     keymaster_error_t SetAuthorizations(const AuthorizationSet& key_description,
                                         keymaster_key_origin_t origin,
                                         AuthorizationSet* hw_enforced,
                                         AuthorizationSet* sw_enforced) const;
+    /*
+     * Blobs created before the root of trust was bound by digest carry the
+     * verified boot key, boot state and lock state as three separate
+     * ROOT_OF_TRUST entries; |legacy_root_of_trust| selects that form.
+     */
     keymaster_error_t BuildHiddenAuthorizations(
             const AuthorizationSet& input_set,
+            bool legacy_root_of_trust,
             AuthorizationSet* hidden) const;
+    static bool ComputeRootOfTrustDigest(
+            const Buffer& verified_boot_key,
+            keymaster_verified_boot_t verified_boot_state,
+            bool device_locked,
+            uint8_t digest[kRootOfTrustDigestSize]);
+    /*
+     * ParseKeyBlob that also reports whether |blob| turned out to be bound
+     * to the root of trust in the legacy form.
+     */
+    keymaster_error_t ParseKeyBlob(const KeymasterKeyBlob& blob,
+                                   const AuthorizationSet& additional_params,
+                                   UniquePtr<Key>* key,
+                                   bool* legacy_root_of_trust) const;
     keymaster_error_t DeriveMasterKey(KeymasterKeyBlob* master_key) const;
+    bool InitializeMasterKey() const;
     /*
      * CreateAuthEncryptedKeyBlob takes a key description authorization set, key
      * material, and hardware and software authorization sets and produces an
@@ -153,10 +219,16 @@ private:
     UniquePtr<KeyFactory> hmac_factory_;
     UniquePtr<KeyFactory> rsa_factory_;
 
-    bool rng_initialized_;
-    mutable int calls_since_reseed_;
+    mutable EntropyPool entropy_pool_;
+    mutable size_t bytes_since_reseed_;
+    mutable uint64_t last_reseed_ms_ = 0;
+    bool reseed_failed_ = false;
     uint8_t auth_token_key_[kAuthTokenKeySize];
     bool auth_token_key_initialized_;
+    mutable uint8_t master_key_[kMasterKeySize];
+    mutable bool master_key_initialized_ = false;
+    mutable KeyBlobCache key_cache_;
+    mutable KeyPool key_pool_;
 
     bool root_of_trust_set_ = false;
     bool version_info_set_ = false;
@@ -167,6 +239,8 @@ private:
             KM_VERIFIED_BOOT_UNVERIFIED;
     bool device_locked_ = false;
     Buffer verified_boot_hash_;
+    uint8_t root_of_trust_digest_[kRootOfTrustDigestSize];
+    bool root_of_trust_digest_valid_ = false;
 };
 
 }  // namespace keymaster
@@ -175,6 +175,71 @@ struct AppendAttestationCertChainRequest : public KeymasterMessage {
 
 struct AppendAttestationCertChainResponse : public NoResponse {};
 
+/**
+ * Runs a complete begin/update/finish sequence with |key_blob| in one call.
+ * The key blob travels as a plain length-prefixed buffer, which is the same
+ * wire format BeginOperationRequest uses for it.
+ */
+struct OneshotOperationRequest : public KeymasterMessage {
+    explicit OneshotOperationRequest(int32_t ver = MAX_MESSAGE_VERSION)
+            : KeymasterMessage(ver) {}
+
+    size_t SerializedSize() const override {
+        return sizeof(uint32_t) + key_blob.SerializedSize() +
+               additional_params.SerializedSize() + input.SerializedSize() +
+               signature.SerializedSize();
+    }
+    uint8_t* Serialize(uint8_t* buf, const uint8_t* end) const override {
+        buf = append_uint32_to_buf(buf, end, purpose);
+        buf = key_blob.Serialize(buf, end);
+        buf = additional_params.Serialize(buf, end);
+        buf = input.Serialize(buf, end);
+        return signature.Serialize(buf, end);
+    }
+    bool Deserialize(const uint8_t** buf_ptr, const uint8_t* end) override {
+        return copy_uint32_from_buf(buf_ptr, end, &purpose) &&
+               key_blob.Deserialize(buf_ptr, end) &&
+               additional_params.Deserialize(buf_ptr, end) &&
+               input.Deserialize(buf_ptr, end) &&
+               signature.Deserialize(buf_ptr, end);
+    }
+
+    keymaster_purpose_t purpose;
+    Buffer key_blob;
+    AuthorizationSet additional_params;
+    Buffer input;
+    Buffer signature;
+};
+
+struct OneshotOperationResponse : public KeymasterResponse {
+    explicit OneshotOperationResponse(int32_t ver = MAX_MESSAGE_VERSION)
+            : KeymasterResponse(ver) {}
+
+    size_t NonErrorSerializedSize() const override {
+        return output.SerializedSize() + output_params.SerializedSize() +
+               enforced.SerializedSize() + unenforced.SerializedSize();
+    }
+    uint8_t* NonErrorSerialize(uint8_t* buf,
+                               const uint8_t* end) const override {
+        buf = output.Serialize(buf, end);
+        buf = output_params.Serialize(buf, end);
+        buf = enforced.Serialize(buf, end);
+        return unenforced.Serialize(buf, end);
+    }
+    bool NonErrorDeserialize(const uint8_t** buf_ptr,
+                             const uint8_t* end) override {
+        return output.Deserialize(buf_ptr, end) &&
+               output_params.Deserialize(buf_ptr, end) &&
+               enforced.Deserialize(buf_ptr, end) &&
+               unenforced.Deserialize(buf_ptr, end);
+    }
+
+    Buffer output;
+    AuthorizationSet output_params;
+    AuthorizationSet enforced;
+    AuthorizationSet unenforced;
+};
+
 /**
  * For Android Things Attestation Provisioning (ATAP), the GetCaRequest message
  * in the protocol are raw opaque messages for the purposes of this IPC call.